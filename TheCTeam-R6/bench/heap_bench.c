@@ -0,0 +1,348 @@
+/**
+ * @file heap_bench.c
+ * @brief Host-side benchmark for the MPX heap manager in lib/mem_lib.c.
+ *
+ * Builds natively on Linux against a stub sys_alloc_mem() and replays
+ * allocation traces through allocate_memory(), callocate_memory(),
+ * reallocate_memory() and free_memory(). Reports throughput, worst-case
+ * latency and how fragmentation develops over the run, so allocator variants
+ * can be compared on the same workload.
+ *
+ * Trace format, one call per line, all numbers in hex:
+ * - a <id> <size>            allocate_memory(size) returned id
+ * - c <id> <count> <size>    callocate_memory(count, size) returned id
+ * - r <old> <new> <size>     reallocate_memory(old, size) returned new
+ * - f <id>                   free_memory(id)
+ * An id of 0 means the call failed when the trace was recorded. Lines
+ * starting with '#' are comments. A kernel built with -DHEAP_TRACE writes
+ * this format to COM2.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem_lib.h"
+
+/* Symbols mem_lib.c expects from the kernel */
+struct pcb *current_process = NULL;
+
+/* the kernel heap hands out zero-filled pages, and mem_lib.c relies on it */
+void *sys_alloc_mem(size_t size)
+{
+	return calloc(1, size);
+}
+
+void print_e(char *string)
+{
+	fprintf(stderr, "%s\n", string);
+}
+
+/* A recorded call */
+struct op {
+	char kind;
+	unsigned long id;
+	unsigned long new_id;
+	size_t count;
+	size_t size;
+};
+
+/* Open-addressed map from trace ids to live addresses */
+struct live_map {
+	unsigned long *ids;
+	void **addrs;
+	size_t capacity;
+	size_t used;
+};
+
+static size_t slot_of(const struct live_map *map, unsigned long id)
+{
+	size_t i = (size_t)(id * 2654435761UL) & (map->capacity - 1);
+	while (map->ids[i] != 0 && map->ids[i] != id) {
+		i = (i + 1) & (map->capacity - 1);
+	}
+	return i;
+}
+
+static void map_put(struct live_map *map, unsigned long id, void *addr)
+{
+	size_t i = slot_of(map, id);
+	if (map->ids[i] == 0) {
+		map->used++;
+	}
+	map->ids[i] = id;
+	map->addrs[i] = addr;
+}
+
+static void *map_take(struct live_map *map, unsigned long id)
+{
+	size_t i = slot_of(map, id);
+	if (map->ids[i] == 0) {
+		return NULL;
+	}
+	void *addr = map->addrs[i];
+
+	/* backward-shift deletion keeps probe chains intact */
+	size_t j = i;
+	map->ids[i] = 0;
+	map->used--;
+	for (;;) {
+		j = (j + 1) & (map->capacity - 1);
+		if (map->ids[j] == 0) {
+			break;
+		}
+		size_t home = (size_t)(map->ids[j] * 2654435761UL) & (map->capacity - 1);
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			map->ids[i] = map->ids[j];
+			map->addrs[i] = map->addrs[j];
+			map->ids[j] = 0;
+			i = j;
+		}
+	}
+	return addr;
+}
+
+static struct op *load_trace(const char *path, size_t *nops)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	size_t cap = 1024, n = 0;
+	struct op *ops = malloc(cap * sizeof(*ops));
+	char line[256];
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct op op = { 0 };
+		int ok = 0;
+
+		switch (line[0]) {
+		case 'a':
+			ok = sscanf(line + 1, "%lx %zx", &op.id, &op.size) == 2;
+			break;
+		case 'c':
+			ok = sscanf(line + 1, "%lx %zx %zx", &op.id, &op.count, &op.size) == 3;
+			break;
+		case 'r':
+			ok = sscanf(line + 1, "%lx %lx %zx", &op.id, &op.new_id, &op.size) == 3;
+			break;
+		case 'f':
+			ok = sscanf(line + 1, "%lx", &op.id) == 1;
+			break;
+		default:
+			continue;
+		}
+		if (!ok) {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			continue;
+		}
+
+		op.kind = line[0];
+		if (n == cap) {
+			cap *= 2;
+			ops = realloc(ops, cap * sizeof(*ops));
+		}
+		ops[n++] = op;
+	}
+
+	fclose(f);
+	*nops = n;
+	return ops;
+}
+
+/* Writes a random workload of nops calls in trace format */
+static void generate_trace(size_t nops, unsigned seed)
+{
+	unsigned long *live = malloc(nops * sizeof(*live));
+	size_t nlive = 0;
+	unsigned long next_id = 1;
+
+	srand(seed);
+	printf("# generated: %zu calls, seed %u\n", nops, seed);
+	for (size_t i = 0; i < nops; i++) {
+		int roll = rand() % 100;
+		if (nlive > 0 && (roll < 40 || nlive > 200)) {
+			size_t k = (size_t)rand() % nlive;
+			printf("f %lx\n", live[k]);
+			live[k] = live[--nlive];
+		} else if (nlive > 0 && roll < 50) {
+			size_t k = (size_t)rand() % nlive;
+			printf("r %lx %lx %x\n", live[k], next_id, 8 + rand() % 600);
+			live[k] = next_id++;
+		} else if (roll < 55) {
+			printf("c %lx %x %x\n", next_id, 1 + rand() % 16, 4 + rand() % 28);
+			live[nlive++] = next_id++;
+		} else {
+			/* mostly small, repeating sizes with the odd large block */
+			int size = (rand() % 10 == 0) ? 512 + rand() % 2048 : 16 * (1 + rand() % 8);
+			printf("a %lx %x\n", next_id, size);
+			live[nlive++] = next_id++;
+		}
+	}
+	free(live);
+}
+
+static long elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static void print_sample(size_t done)
+{
+	heap_stats stats;
+	heap_get_stats(&stats);
+	printf("%10zu %10zu %10zu %10zu %6d%% %8zu\n", done, stats.bytes_in_use,
+	       stats.free_bytes, stats.largest_free, stats.fragmentation,
+	       stats.deferred_blocks);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d] [-H heap_bytes] [-n repeats] [-s sample_every] trace\n"
+		"       %s -g calls [seed]\n"
+		"  -d  enable deferred coalescing\n"
+		"  -g  write a random trace to stdout\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	size_t heap_size = 50000;
+	size_t repeats = 1;
+	size_t sample_every = 0;
+	int deferred = 0;
+	int argi = 1;
+
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		char flag = argv[argi][1];
+		if (flag == 'd') {
+			deferred = 1;
+		} else if (flag == 'g' && argi + 1 < argc) {
+			unsigned seed = argi + 2 < argc ? (unsigned)strtoul(argv[argi + 2], NULL, 0) : 1;
+			generate_trace(strtoul(argv[argi + 1], NULL, 0), seed);
+			return 0;
+		} else if (argi + 1 < argc && (flag == 'H' || flag == 'n' || flag == 's')) {
+			size_t value = strtoul(argv[++argi], NULL, 0);
+			if (flag == 'H') heap_size = value;
+			if (flag == 'n') repeats = value;
+			if (flag == 's') sample_every = value;
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argi != argc - 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	size_t nops;
+	struct op *ops = load_trace(argv[argi], &nops);
+	if (ops == NULL || nops == 0) {
+		return 1;
+	}
+
+	initialize_heap(heap_size);
+	set_deferred_coalescing(deferred);
+
+	struct live_map map = { 0 };
+	map.capacity = 1;
+	while (map.capacity < 2 * nops) {
+		map.capacity <<= 1;
+	}
+	map.ids = calloc(map.capacity, sizeof(*map.ids));
+	map.addrs = calloc(map.capacity, sizeof(*map.addrs));
+
+	long total_ns = 0, worst_ns = 0;
+	size_t worst_at = 0, done = 0, failures = 0;
+	char worst_kind = '?';
+
+	if (sample_every) {
+		printf("%10s %10s %10s %10s %7s %8s\n", "calls", "in_use", "free", "largest", "frag", "deferred");
+	}
+
+	for (size_t rep = 0; rep < repeats; rep++) {
+		for (size_t i = 0; i < nops; i++) {
+			const struct op *op = &ops[i];
+			void *old = NULL, *result = NULL;
+			struct timespec t0, t1;
+
+			/* look ups are done outside the timed region */
+			if (op->kind == 'f' || op->kind == 'r') {
+				old = map_take(&map, op->id);
+				if (old == NULL && op->kind == 'f') {
+					continue;
+				}
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			switch (op->kind) {
+			case 'a': result = allocate_memory(op->size); break;
+			case 'c': result = callocate_memory(op->count, op->size); break;
+			case 'r': result = reallocate_memory(old, op->size); break;
+			case 'f': free_memory(old); break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			long ns = elapsed_ns(&t0, &t1);
+			total_ns += ns;
+			if (ns > worst_ns) {
+				worst_ns = ns;
+				worst_at = i;
+				worst_kind = op->kind;
+			}
+
+			if (op->kind != 'f') {
+				unsigned long id = op->kind == 'r' ? op->new_id : op->id;
+				if (result == NULL) {
+					failures++;
+					if (op->kind == 'r' && old != NULL) {
+						/* a failed realloc leaves the old block live */
+						map_put(&map, op->id, old);
+					}
+				} else if (id == 0) {
+					/* failed when recorded; don't let it pin memory here */
+					free_memory(result);
+				} else {
+					map_put(&map, id, result);
+				}
+			}
+
+			done++;
+			if (sample_every && done % sample_every == 0) {
+				print_sample(done);
+			}
+		}
+
+		/* release what the trace left live so the next pass starts clean */
+		for (size_t i = 0; i < map.capacity; i++) {
+			if (map.ids[i] != 0) {
+				free_memory(map.addrs[i]);
+				map.ids[i] = 0;
+			}
+		}
+		map.used = 0;
+	}
+
+	heap_stats stats;
+	heap_get_stats(&stats);
+
+	printf("trace:             %s (%zu calls x %zu)\n", argv[argi], nops, repeats);
+	printf("mode:              %s coalescing, %zu byte heap\n", deferred ? "deferred" : "immediate", heap_size);
+	printf("calls timed:       %zu\n", done);
+	printf("throughput:        %.0f calls/s\n", total_ns ? done * 1e9 / total_ns : 0.0);
+	printf("mean latency:      %.1f ns\n", done ? (double)total_ns / done : 0.0);
+	printf("worst latency:     %ld ns (call %zu, '%c')\n", worst_ns, worst_at, worst_kind);
+	printf("failed calls:      %zu\n", failures);
+	printf("peak in use:       %zu bytes\n", stats.peak_bytes_in_use);
+
+	free(map.ids);
+	free(map.addrs);
+	free(ops);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file heap_owner_test.c
+ * @brief Host-side test of heap block ownership in lib/mem_lib.c.
+ *
+ * A process's PCB, context and name are allocated while its creator (comhand,
+ * or whichever process loads it) is running. pcb_setup() hands them over to
+ * the kernel with disown_memory(), so reclaiming the creator's memory when it
+ * exits must leave the child's structures allocated. This makes the same
+ * allocations pcb_setup() does, frees the creator and checks the child.
+ *
+ * Built and run by `make check`, against the same stubs as heap_bench.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pcb.h>
+#include "mem_lib.h"
+
+/* Symbols mem_lib.c expects from the kernel */
+struct pcb *current_process = NULL;
+
+/* the kernel heap hands out zero-filled pages, and mem_lib.c relies on it */
+void *sys_alloc_mem(size_t size)
+{
+	return calloc(1, size);
+}
+
+void print_e(char *string)
+{
+	fprintf(stderr, "%s\n", string);
+}
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+	if (!ok) {
+		failures++;
+	}
+}
+
+int main(void)
+{
+	initialize_heap(50000);
+
+	/* the creator is running and has memory of its own */
+	pcb creator = { 0 };
+	current_process = &creator;
+	char *scratch = allocate_memory(64);
+
+	/* the allocations pcb_setup() makes for the child */
+	pcb *child = allocate_memory(sizeof(pcb));
+	check(child != NULL && disown_memory(child) == 0, "PCB disowned");
+	child->context = allocate_memory(sizeof(context));
+	check(child->context != NULL && disown_memory(child->context) == 0, "context disowned");
+	child->name = allocate_memory(sizeof("child"));
+	check(child->name != NULL && disown_memory((void *)child->name) == 0, "name disowned");
+	strcpy((char *)child->name, "child");
+	child->owned_blocks = NULL;
+	check(disown_memory(scratch + 1) == -1, "disowning an address that starts no block fails");
+
+	/* the child runs and allocates for itself */
+	current_process = child;
+	char *mine = allocate_memory(32);
+
+	/* the creator exits while the child is alive */
+	current_process = NULL;
+	check(free_process_memory(&creator) == 1, "only the creator's own block is reclaimed");
+
+	/* the child's structures are still allocated, so new blocks cannot land on them */
+	char *fresh = allocate_memory(sizeof(pcb) + 64);
+	check(fresh != NULL, "allocation after the creator exits");
+	memset(fresh, 0xAA, sizeof(pcb) + 64);
+	check(strcmp(child->name, "child") == 0 && child->owned_blocks != NULL, "child's structures intact");
+
+	/* the child exits: its own allocation goes, its kernel structures are freed by pcb_free() */
+	check(free_process_memory(child) == 1 && mine != NULL, "child's own block is reclaimed");
+	check(free_memory((void *)child->name) == 0, "name still freeable");
+	check(free_memory(child->context) == 0, "context still freeable");
+	check(free_memory(child) == 0, "PCB still freeable");
+	check(free_memory(fresh) == 0, "heap consistent");
+
+	return failures != 0;
+}
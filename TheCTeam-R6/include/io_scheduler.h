@@ -17,9 +17,29 @@
  * @{
  */
 #define ERR_INVALID_OPERATION -1          /**< Error: Invalid operation type. */
-#define ERR_MEMORY_ALLOCATION -1          /**< Error: Memory allocation failure. */
+#define ERR_INVALID_HANDLE -401           /**< Error: No outstanding async request of the caller has this handle. */
+#define ERR_TOO_MANY_REQUESTS -402        /**< Error: All async request handles are in use. */
+#define ERR_IO_QUEUE_FULL -403            /**< Error: The device has no free IOCB for another queued request. */
+#define ERR_MEMORY_ALLOCATION -404        /**< Error: Memory allocation failure. */
 /** @} */
 
+/** @name IOCB Pool
+ * @{
+ */
+#define DCB_IOCB_POOL_SIZE 16             /**< IOCBs each DCB has for requests that wait for a channel. */
+#define DCB_IOCB_RESERVED 2               /**< IOCBs kept back for blocking requests already started, one per channel. */
+/** @} */
+
+/**
+ * @brief Number of async requests that can be outstanding at once, across all processes.
+ */
+#define IO_MAX_ASYNC 16
+
+/**
+ * @brief Number of processes that can be blocked in SELECT at once.
+ */
+#define IO_MAX_SELECT 8
+
 /**
  * @brief Structure representing an I/O Control Block (IOCB).
  */
@@ -30,23 +50,37 @@ typedef struct iocb {
     struct iocb* next;        /**< Pointer to the next IOCB in the queue. */
     struct pcb* process;      /**< Pointer to the associated process (PCB). */
     int waiting;              /**< Flag: 1 if waiting for completion, 0 if pending. */
+    int handle;               /**< Handle of an async request, 0 for a blocking one. */
+    int done;                 /**< Set once an async request has completed. */
+    int result;               /**< Bytes transferred by a completed async request, or an error code. */
+    int waited;               /**< Set while the owner is blocked in WAIT on this request. */
+    struct dcb* dcb;          /**< DCB whose pool the IOCB belongs to. */
 } iocb;
 
 /**
- * @brief Enqueues an IOCB to the specified DCB's queue.
+ * @brief Returns the channel of a DCB that serves an operation.
+ * 
+ * @param dcb Pointer to the DCB.
+ * @param operation READ for the receive channel, WRITE for the transmit channel.
+ * @return Pointer to the channel.
+ */
+dcb_channel* dcb_channel_for(dcb* dcb, int operation);
+
+/**
+ * @brief Enqueues an IOCB to the specified channel's queue.
  * 
- * @param dcb Pointer to the DCB where the IOCB will be enqueued.
+ * @param channel Pointer to the channel where the IOCB will be enqueued.
  * @param iocb Pointer to the IOCB to be enqueued.
  */
-void enqueue_iocb(dcb* dcb, iocb* iocb);
+void enqueue_iocb(dcb_channel* channel, iocb* iocb);
 
 /**
- * @brief Dequeues an IOCB from the specified DCB's queue.
+ * @brief Dequeues an IOCB from the specified channel's queue.
  * 
- * @param dcb Pointer to the DCB from which the IOCB will be dequeued.
+ * @param channel Pointer to the channel from which the IOCB will be dequeued.
  * @return Pointer to the dequeued IOCB, or NULL if the queue is empty.
  */
-iocb* dequeue_iocb(dcb* dcb);
+iocb* dequeue_iocb(dcb_channel* channel);
 
 /**
  * @brief Schedules an I/O operation.
@@ -57,19 +91,114 @@ iocb* dequeue_iocb(dcb* dcb);
  * @param size Size of the buffer.
  * @param pcb Pointer to the PCB of the associated process.
  * @param waiting Flag indicating if the operation requires waiting for completion.
- * @return SUCCESS if the operation is successfully scheduled, or an error code.
+ * @return SUCCESS if the operation is successfully scheduled, ERR_IO_QUEUE_FULL if the device's
+ *         IOCB pool cannot take it, or another error code.
  */
 int io_scheduler(int operation, device dev, char* buffer, size_t size, pcb* pcb, int waiting);
 
 /**
- * @brief Processes the next IOCB in the specified DCB's queue.
+ * @brief Starts an async I/O operation without blocking the caller.
+ *
+ * The operation starts at once if its channel is idle and is queued otherwise. Each request holds
+ * a handle until the owner collects its result with io_wait().
+ * 
+ * @param operation The type of operation (READ or WRITE).
+ * @param dev The target device for the I/O operation.
+ * @param buffer Pointer to the buffer for the operation; it must stay valid until the request completes.
+ * @param size Size of the buffer.
+ * @param pcb Pointer to the PCB of the process that owns the request.
+ * @return A positive request handle, or an error code.
+ */
+int io_submit(int operation, device dev, char* buffer, size_t size, pcb* pcb);
+
+/**
+ * @brief Checks whether an async request has completed.
+ * 
+ * @param handle Handle returned by io_submit().
+ * @param pcb Pointer to the PCB of the process that owns the request.
+ * @return 1 if the request has completed, 0 if it is still in progress, or ERR_INVALID_HANDLE.
+ */
+int io_poll(int handle, pcb* pcb);
+
+/**
+ * @brief Collects the result of an async request.
+ *
+ * If the request has completed its handle is released and the result stored. Otherwise the request
+ * is marked so that completing it releases the handle and readies the owner with the result in EAX;
+ * the caller is expected to block the owner.
+ * 
+ * @param handle Handle returned by io_submit().
+ * @param pcb Pointer to the PCB of the process that owns the request.
+ * @param result Where the result of a completed request is stored.
+ * @return 1 if the request had completed, 0 if the owner has to block, or ERR_INVALID_HANDLE.
+ */
+int io_wait(int handle, pcb* pcb, int* result);
+
+/**
+ * @brief Checks a set of devices for ready events, or registers the caller to wait for one.
+ *
+ * The revents of every entry are set to its ready events. If none are ready the process is
+ * recorded, and io_select_wake() readies it once one is, with the index in EAX; the caller is
+ * expected to block the process.
+ * 
+ * @param set Array of devices and the events to watch on each.
+ * @param count Number of entries in the array.
+ * @param pcb Pointer to the PCB of the calling process.
+ * @param fired Where the index of the first ready entry is stored.
+ * @return 1 if an entry was ready, 0 if the process has to block, or an error code.
+ */
+int io_select(struct select_entry* set, int count, pcb* pcb, int* fired);
+
+/**
+ * @brief Readies every process blocked in SELECT that now has an event.
+ *
+ * Called from sys_call() after completed I/O has been handled.
+ */
+void io_select_wake(void);
+
+/**
+ * @brief Releases the outstanding I/O requests of a process that is being freed.
+ *
+ * Requests still queued are dropped and their IOCBs returned to the pool. An operation of the
+ * process that is in progress is stopped, so the device no longer uses its buffer, and the
+ * requests queued behind it go on at the next dispatch. A SELECT the process is blocked in
+ * is given up as well. Called from pcb_free().
+ * 
+ * @param pcb Pointer to the PCB being freed.
+ */
+void io_release_process(pcb* pcb);
+
+/**
+ * @brief Processes the next IOCB in one of the specified DCB's queues.
  * 
  * @param dcb Pointer to the DCB whose IOCB queue will be processed.
+ * @param operation READ to process the receive queue, WRITE for the transmit queue.
+ */
+void process_next_iocb(dcb* dcb, int operation);
+
+/**
+ * @brief Allocates a DCB's IOCB pool and links every IOCB into its free list.
+ * 
+ * @param dcb Pointer to the DCB that gets the pool.
+ * @return SUCCESS, or ERR_MEMORY_ALLOCATION if the pool could not be allocated.
+ */
+int iocb_pool_init(dcb* dcb);
+
+/**
+ * @brief Takes an IOCB from a DCB's pool.
+ *
+ * New requests are only admitted while more than DCB_IOCB_RESERVED IOCBs are free. The reserve is
+ * for requests that have already started and only need an IOCB to block their process, so those
+ * can always complete.
+ * 
+ * @param dcb Pointer to the DCB whose pool is used.
+ * @param waiting Non-zero for a request that has already started.
+ * @return Pointer to the IOCB, or NULL if the request is not admitted.
  */
-void process_next_iocb(dcb* dcb);
+iocb* iocb_alloc(dcb* dcb, int waiting);
 
 /**
- * @brief Frees an IOCB structure.
+ * @brief Returns an IOCB to the pool of its DCB.
  * 
  * @param iocb Pointer to the IOCB to be freed.
  * @return SUCCESS if the IOCB is successfully freed, or an error code.
@@ -59,9 +59,34 @@ void show_allocated_memory(void);
  * prints information about each one. The information includes:
  * - The start address of the block (in hexadecimal).
  * - The size of the block (in decimal).
+ * Blocks freed but still awaiting a deferred merge are listed too, marked
+ * "(awaiting merge)", so the free and allocated listings cover the whole heap.
  *
  * @return void
  */
 void show_free_memory(void);
 
+/**
+ * @brief Displays a summary of the heap.
+ *
+ * Prints the bytes in use and their peak, the free space, the largest free 
+ * block, the external fragmentation and the allocation, free and failure 
+ * counts. The report is assembled in a local buffer and written with a 
+ * single system call.
+ *
+ * @return void
+ */
+void show_heap_stats(void);
+
+/**
+ * @brief Measures the cost of a page directory switch.
+ *
+ * Times a run of CR3 reloads, each followed by touching a few kernel pages,
+ * once with the kernel pages marked global and once with global pages
+ * turned off, and prints the average cycles per switch for both.
+ *
+ * @return void
+ */
+void bench_switch(void);
+
 #endif // MEMUSER_H
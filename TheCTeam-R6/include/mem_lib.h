@@ -14,6 +14,21 @@
  * - initialize_heap(): Initializes a single large free block for memory management.
  * - allocate_memory(): Allocates a block of memory, potentially splitting a free block.
  * - free_memory(): Frees a previously allocated block, merging with adjacent free blocks if possible.
+ * - reallocate_memory(): Resizes a block in place when a neighbouring block allows it.
+ * - callocate_memory(): Allocates zeroed memory, skipping memory that has never been used.
+ * - heap_get_stats(): Reports usage counters and fragmentation of the heap.
+ * - free_process_memory(): Releases every block owned by a process in one pass.
+ * - disown_memory(): Hands a block over to the kernel, out of its process's chain.
+ * - heap_defragment(): Merges blocks whose coalescing was deferred.
+ *
+ * Every allocated block is tagged with the process that was running when it 
+ * was allocated and linked into that process's chain, so memory a process 
+ * never freed can be reclaimed when the process goes away.
+ *
+ * With deferred coalescing enabled, small freed blocks with no free 
+ * neighbour are parked on quick lists by size class instead of being merged. 
+ * An allocation of the same class reuses them without a split, and 
+ * heap_defragment() merges whatever is left when the system is idle.
  */
 
 #ifndef MEMORY_MANAGER_H
@@ -21,6 +36,8 @@
 
 #include <stddef.h>
 
+struct pcb;
+
 /**
  * @enum mcb_status
  * @brief Status of a memory block.
@@ -29,7 +46,8 @@
  */
 typedef enum {
     FREE,         /**< Indicates the block is free and available for allocation. */
-    ALLOCATED     /**< Indicates the block is currently allocated and in use. */
+    ALLOCATED,    /**< Indicates the block is currently allocated and in use. */
+    DEFERRED      /**< Indicates the block was freed but sits on a quick list, not yet merged. */
 } mcb_status;
 
 /**
@@ -46,8 +64,34 @@ typedef struct mcb {
     mcb_status status;    /**< Status of the block (FREE or ALLOCATED). */
     struct mcb *next;     /**< Pointer to the next MCB in the list. */
     struct mcb *prev;     /**< Pointer to the previous MCB in the list. */
+    struct pcb *owner;    /**< Process that allocated the block (NULL for the kernel). */
+    struct mcb *owner_next; /**< Next block in the owner's chain of allocated blocks. */
+    struct mcb *owner_prev; /**< Previous block in the owner's chain of allocated blocks. */
+    struct mcb *quick_next; /**< Next block on the same quick list while DEFERRED. */
 } mcb;
 
+/**
+ * @struct heap_stats
+ * @brief Snapshot of the allocator's counters.
+ *
+ * The usage and count fields are maintained on every allocation and free. 
+ * The free-space fields are computed by heap_get_stats() when the snapshot 
+ * is taken.
+ */
+typedef struct heap_stats {
+    size_t heap_size;           /**< Total bytes managed by the heap, including MCBs. */
+    size_t bytes_in_use;        /**< Bytes currently held by allocated blocks. */
+    size_t peak_bytes_in_use;   /**< High-water mark of bytes_in_use. */
+    size_t alloc_count;         /**< Number of successful allocations. */
+    size_t free_count;          /**< Number of successful frees. */
+    size_t failed_allocs;       /**< Number of allocations that found no block. */
+    size_t free_bytes;          /**< Bytes held by free blocks. */
+    size_t free_blocks;         /**< Number of free blocks. */
+    size_t largest_free;        /**< Size of the largest free block. */
+    size_t deferred_blocks;     /**< Freed blocks waiting on the quick lists to be merged. */
+    int fragmentation;          /**< External fragmentation, 0-100: 100 * (1 - largest_free / free_bytes). */
+} heap_stats;
+
 /**
  * @brief Head of the MCB linked list.
  *
@@ -92,4 +136,96 @@ void *allocate_memory(size_t size);
  */
 int free_memory(void* address);
 
+/**
+ * @brief Resizes a previously allocated block of memory.
+ *
+ * Shrinking splits the unused tail off as a new free block. Growing first 
+ * tries to absorb the next block if it is free and large enough, so the data 
+ * does not move. Only when that fails is a new block allocated, the contents 
+ * copied and the old block freed.
+ *
+ * @param address Start address of the block to resize, or NULL to allocate.
+ * @param size The new size in bytes. A size of 0 frees the block.
+ * @return void* Start address of the resized block (NULL on failure, in which 
+ *               case the original block is left untouched).
+ */
+void *reallocate_memory(void *address, size_t size);
+
+/**
+ * @brief Allocates a zero-filled block for count elements of size bytes.
+ *
+ * initialize_heap() no longer clears the heap, so each block is zeroed here. 
+ * The allocator tracks how far into the heap it has ever written, and only 
+ * the part of the new block below that mark needs clearing; memory beyond it 
+ * has never been handed out and is still zero from the kernel heap, whose 
+ * pages are zero-filled on first touch.
+ *
+ * @param count Number of elements.
+ * @param size Size of each element in bytes.
+ * @return void* Pointer to the zeroed memory (NULL on failure or overflow).
+ */
+void *callocate_memory(size_t count, size_t size);
+
+/**
+ * @brief Takes a snapshot of the heap counters.
+ *
+ * Copies the running counters and walks the MCB list once to find the free 
+ * space, the largest free block and the fragmentation ratio.
+ *
+ * @param stats Structure that receives the snapshot.
+ * @return void
+ */
+void heap_get_stats(heap_stats *stats);
+
+/**
+ * @brief Frees every block owned by a process.
+ *
+ * Walks the process's chain of allocated blocks and marks them all free, 
+ * then merges adjacent free blocks in a single pass over the heap instead 
+ * of coalescing after each block.
+ *
+ * @param owner The process whose memory is reclaimed.
+ * @return int The number of blocks freed.
+ */
+int free_process_memory(struct pcb *owner);
+
+/**
+ * @brief Hands an allocated block over to the kernel.
+ *
+ * Unlinks the block from the chain of the process that allocated it, so 
+ * free_process_memory() leaves it alone. Used for kernel structures, such as 
+ * a new process's PCB, that are allocated while another process is running 
+ * and must outlive it.
+ *
+ * @param address Start address of the block.
+ * @return int 0 on success, or -1 if no allocated block starts at address 
+ *             (e.g. memory that came from kmalloc()).
+ */
+int disown_memory(void *address);
+
+/**
+ * @brief Merges every block whose coalescing was deferred.
+ *
+ * Moves all blocks off the quick lists back to FREE, merging each with its 
+ * free neighbours. The work is bounded by the number of deferred blocks (at 
+ * most one more than the quick list limit), not by the size of the heap. 
+ * Called from the idle path, when the quick lists grow past their limit, and 
+ * when an allocation would otherwise fail.
+ *
+ * @return void
+ */
+void heap_defragment(void);
+
+/**
+ * @brief Enables or disables deferred coalescing.
+ *
+ * When enabled, free_memory() puts blocks of up to 512 bytes on a quick 
+ * list for their size class instead of merging them with their neighbours. 
+ * Disabling it merges any blocks still waiting.
+ *
+ * @param enabled Non-zero to defer coalescing, 0 to merge on every free.
+ * @return void
+ */
+void set_deferred_coalescing(int enabled);
+
 #endif // MEMORY_MANAGER_H
@@ -12,6 +12,16 @@
 /** Enable interrupts */
 #define sti() __asm__ volatile ("sti")
 
+/**
+ Saves EFLAGS into flags and disables interrupts. Unlike cli()/sti(), a section
+ between irq_save() and irq_restore() leaves interrupts off if they were off
+ before, e.g. inside an interrupt gate.
+*/
+#define irq_save(flags) __asm__ volatile ("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory")
+
+/** Restores EFLAGS, and with it the interrupt flag, saved by irq_save() */
+#define irq_restore(flags) __asm__ volatile ("push %0\n\tpopf" : : "g"(flags) : "memory", "cc")
+
 /**
  Installs the initial interrupt handlers for the first 32 IRQ lines. Most do a
  panic for now.
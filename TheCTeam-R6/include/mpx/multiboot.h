@@ -0,0 +1,51 @@
+#ifndef MPX_MULTIBOOT_H
+#define MPX_MULTIBOOT_H
+
+/**
+ @file mpx/multiboot.h
+ @brief Structures the Multiboot loader passes to the kernel
+*/
+
+#include <stdint.h>
+
+/** The value the loader leaves in EAX when it boots a Multiboot kernel */
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+/** multiboot_info.flags: mem_lower and mem_upper are valid */
+#define MULTIBOOT_INFO_MEMORY		(1 << 0)
+
+/** multiboot_info.flags: mmap_length and mmap_addr are valid */
+#define MULTIBOOT_INFO_MEM_MAP		(1 << 6)
+
+/** multiboot_mmap_entry.type for RAM the kernel may use */
+#define MULTIBOOT_MEMORY_AVAILABLE	1
+
+/** The boot information structure (only the fields MPX reads) */
+struct multiboot_info {
+	uint32_t flags;		/** which of the fields below are valid */
+	uint32_t mem_lower;	/** KB of memory below 1 MB */
+	uint32_t mem_upper;	/** KB of memory above 1 MB */
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length;	/** size of the memory map in bytes */
+	uint32_t mmap_addr;	/** physical address of the first entry */
+} __attribute__((packed));
+
+/** One region of the memory map */
+struct multiboot_mmap_entry {
+	uint32_t size;		/** size of the rest of the entry, not counting this field */
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} __attribute__((packed));
+
+/** EAX as the loader left it, saved by start in core-asm.s */
+extern uint32_t multiboot_magic;
+
+/** EBX as the loader left it: the physical address of the boot information */
+extern struct multiboot_info *multiboot_info;
+
+#endif
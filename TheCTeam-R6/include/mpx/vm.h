@@ -7,17 +7,84 @@
 */
 
 #include <stddef.h>
+#include <stdint.h>
 
 /**
- Allocates memory from a primitive heap.
+ Allocates memory. Before paging is enabled this comes from a placement
+ allocator and can never be freed; afterwards it is a run of whole pages
+ on the kernel heap, which kfree() can return.
  @param size The size of memory to allocate
  @param align If non-zero, align the allocation to a page boundary
+              (kernel heap allocations are always page aligned)
  @param phys_addr If non-NULL, a pointer to a pointer that will
                   hold the physical address of the new memory
  @return The newly allocated memory
  */
 void *kmalloc(size_t size, int align, void **phys_addr);
 
+/**
+ Frees memory returned by kmalloc() after paging was enabled, releasing
+ the frames behind it.
+ @param addr The address kmalloc() returned
+ @return 0 on success, -1 if addr is not the start of a kernel heap allocation
+*/
+int kfree(void *addr);
+
+/**
+ Reserves a stack with an unmapped guard page directly below it, so that
+ an overflow faults instead of running into another stack. Every usable
+ page is backed with a zeroed frame straight away, since a ring 0 fault
+ on a missing stack page cannot be delivered. There is no double fault
+ task gate, so running into the guard page still resets the machine.
+ @param size The usable size of the stack in bytes, rounded up to whole pages
+ @return The lowest usable address of the stack, or NULL if the stack region
+         or physical memory is exhausted
+*/
+void *vm_alloc_stack(size_t size);
+
+/**
+ Releases a stack from vm_alloc_stack() and the frames behind it.
+ @param stack The address vm_alloc_stack() returned
+*/
+void vm_free_stack(void *stack);
+
+/**
+ Zeroes a few free frames and keeps them for the next pages that are
+ backed on first touch, so that clearing them is off the critical path.
+ Meant to be called when nothing else is runnable.
+*/
+void vm_prezero_frames(void);
+
+/**
+ Creates a page directory for a process that shares all of the kernel's
+ page tables.
+ @return The physical address to load into CR3, or 0 if no memory was
+         available, in which case the kernel directory should be used
+*/
+uint32_t vm_create_space(void);
+
+/**
+ Frees a page directory from vm_create_space(), switching back to the
+ kernel directory first if it is the one in use.
+ @param space The value vm_create_space() returned
+*/
+void vm_destroy_space(uint32_t space);
+
+/**
+ Loads a page directory into CR3 unless it is already loaded.
+ @param space A value from vm_create_space(), or 0 for the kernel directory
+*/
+void vm_switch_space(uint32_t space);
+
+/**
+ Measures the cost of switching page directories, each switch followed
+ by touching a few kernel pages.
+ @param global If zero, global pages are turned off for the measurement
+ @param iterations The number of switches to time
+ @return The average number of TSC cycles per switch, or 0 if it could not run
+*/
+uint32_t vm_bench_switch(int global, uint32_t iterations);
+
 /**
  Initializes the kernel page directory and initial kernel heap area.
  Performs identity mapping of the kernel frames such that the virtual
@@ -25,4 +92,37 @@ void *kmalloc(size_t size, int align, void **phys_addr);
 */
 void vm_init(void);
 
+/**
+ Unmaps a page of kernel memory and returns its physical frame to the
+ frame allocator.
+ @param addr Any address within the page to release
+*/
+void vm_free_page(void *addr);
+
+/**
+ Resolves a page fault on memory that was reserved but not yet backed,
+ mapping a zeroed frame behind the page.
+ @param addr The faulting address, from CR2
+ @param error_code The error code the CPU pushed for the fault
+ @return 0 if the fault was resolved, -1 if it is a genuine fault
+*/
+int vm_page_fault(uintptr_t addr, uint32_t error_code);
+
+/**
+ Allocates physically contiguous pages from the buddy allocator. The pool
+ is identity-mapped, so the returned address is both the virtual and the
+ physical address of the block.
+ @param order The block is 2^order pages (0 to 10)
+ @return The start of the block, or NULL if no block of that order is free
+*/
+void *alloc_pages(unsigned int order);
+
+/**
+ Returns a block obtained from alloc_pages(), merging it with its buddy
+ where possible.
+ @param addr The start of the block
+ @param order The order it was allocated with
+*/
+void free_pages(void *addr, unsigned int order);
+
 #endif
@@ -13,6 +13,7 @@
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -23,6 +24,12 @@
 #include <mpx/io.h>
 #include <sys_call.h>
 
+/**
+ * @def PCB_DEFAULT_STACK_SIZE
+ * @brief Stack size for processes without deep call chains (one page).
+ */
+#define PCB_DEFAULT_STACK_SIZE 4096
+
 /**
  * @enum process_class
  * @brief Defines the class of a process.
@@ -72,9 +79,12 @@ typedef struct pcb {
     int priority;                    /**< Priority of the process (0-9) */
     execution_state exec_state;      /**< Execution state (READY, RUNNING, or BLOCKED) */
     dispatch_state disp_state;       /**< Dispatch state (SUSPENDED or NOT_SUSPENDED) */
-    unsigned char stack[1024];       /**< Stack memory allocated for the process (1024 bytes) */
+    unsigned char* stack;            /**< Lowest address of the process stack, which has a guard page below it */
+    size_t stack_size;               /**< Usable size of the stack in bytes */
     void* stack_pointer;             /**< Pointer to the current position in the stack */
     struct pcb* next_pcb;            /**< Pointer to the next PCB in the queue */
+    struct mcb* owned_blocks;        /**< Head of the chain of heap blocks this process allocated */
+    uint32_t page_dir;               /**< Physical address of the process page directory (CR3), 0 for the kernel directory */
 } pcb;
 
 /**
@@ -125,24 +135,38 @@ pcb* pcb_allocate(void);
  * @brief Frees the memory allocated for a PCB.
  *
  * This function frees the memory occupied by a PCB structure, including any dynamically allocated fields within it.
+ * Any heap memory the process allocated and did not free is reclaimed as well.
  *
  * @param process Pointer to the PCB to be freed.
  * @return 0 on success, non-zero on failure.
  */
 int pcb_free(pcb* process);
 
+/**
+ * @brief Releases the stack of a process that was freed while it was running.
+ *
+ * pcb_free() cannot release the stack the CPU is still on, so an exiting process's
+ * stack is kept until sys_call() has switched away from it. Called at the start of
+ * every sys_call() and by kmain() once the last process has exited.
+ */
+void pcb_reap(void);
+
 /**
  * @brief Creates and initializes a new PCB with the given parameters.
  *
  * This function sets up a new PCB with the specified name, class, and priority.
  * It allocates memory for the PCB, initializes its fields, and ensures that the process name is unique.
+ * The stack is carved from the paged stack region with an unmapped guard page below it,
+ * so an overflow stops the machine instead of corrupting another stack.
  *
  * @param name The unique name of the process.
  * @param class The class of the process (USER_PROCESS or SYSTEM_PROCESS).
  * @param priority The priority of the process (0-9).
+ * @param stack_size Size of the process stack in bytes, rounded up to whole pages. Must be at
+ * least sizeof(struct context), which initialize_context() places at the top.
  * @return Pointer to the newly created PCB, or NULL if creation fails.
  */
-pcb* pcb_setup(const char* name, int class, int priority);
+pcb* pcb_setup(const char* name, int class, int priority, size_t stack_size);
 
 /**
  * @brief Searches for a PCB with the given name in all queues.
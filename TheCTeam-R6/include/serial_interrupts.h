@@ -34,6 +34,8 @@
 #define ERR_PORT_ALREADY_OPEN -103         /**< Port is already open. */
 #define ERR_INVALID_BUFFER_ADDRESS -302    /**< Invalid buffer address. */
 #define ERR_INVALID_COUNT -303             /**< Invalid count value. */
+#define ERR_INVALID_COMMAND -104           /**< Unknown IOCTL command or argument. */
+#define ERR_INVALID_RING_SIZE -105         /**< Receive ring size is not a power of two, or could not be allocated. */
 /** @} */
 
 /** @name Event Flag Definitions
@@ -51,35 +53,88 @@
 #define DCB_WRITING 2                      /**< DCB is writing data. */
 /** @} */
 
+/** @name FIFO Control Definitions
+ * @{
+ */
+#define SERIAL_FIFO_SIZE 16                /**< Depth of the 16550 transmit and receive FIFOs. */
+#define FCR_ENABLE 0x01                    /**< Enables both FIFOs. */
+#define FCR_CLEAR_RX 0x02                  /**< Clears the receive FIFO. */
+#define FCR_CLEAR_TX 0x04                  /**< Clears the transmit FIFO. */
+#define SERIAL_RX_TRIGGER_1 0x00           /**< Input interrupt once 1 byte is waiting. */
+#define SERIAL_RX_TRIGGER_4 0x40           /**< Input interrupt once 4 bytes are waiting. */
+#define SERIAL_RX_TRIGGER_8 0x80           /**< Input interrupt once 8 bytes are waiting (default). */
+#define SERIAL_RX_TRIGGER_14 0xC0          /**< Input interrupt once 14 bytes are waiting. */
+#define SERIAL_TX_RING_SIZE 1024           /**< Bytes of output each port can hold before WRITE blocks. */
+#define SERIAL_RX_RING_SIZE 1024           /**< Receive ring size used by the kernel's own ports; any power of two can be passed to serial_open(). */
+/** @} */
+
+/** @name Terminal Mode Definitions
+ * @{
+ */
+#define SERIAL_MODE_CANONICAL 0            /**< Line editing and echo, a read ends at a carriage return or newline (default). */
+#define SERIAL_MODE_RAW 1                  /**< No echo or editing, a read ends when full or the line goes quiet. */
+#define SERIAL_RAW_TRIGGER_BYTES 14        /**< Receive FIFO trigger level used in raw mode, in bytes. */
+#define SERIAL_SET_MODE 1                  /**< IOCTL command: argument is SERIAL_MODE_CANONICAL or SERIAL_MODE_RAW. */
+#define SERIAL_SET_RX_TRIGGER 2            /**< IOCTL command: argument is one of SERIAL_RX_TRIGGER_*. */
+/** @} */
+
 /** @name PIC Definitions
  * @{
  */
 #define PIC_MASK_PORT 0x21                 /**< PIC mask port address. */
 #define PIC_COMMAND_PORT 0x20              /**< PIC command port address. */
 #define PIC_EOI 0x20                       /**< End of Interrupt signal. */
+#define PIC_VECTOR_BASE 0x20               /**< Interrupt vector of IRQ0; IRQn is delivered on PIC_VECTOR_BASE + n. */
+#define SERIAL_IRQ_COM1_COM3 4             /**< IRQ line shared by COM1 and COM3. */
+#define SERIAL_IRQ_COM2_COM4 3             /**< IRQ line shared by COM2 and COM4. */
 /** @} */
 
 
 
 
 
+/**
+ * @brief One direction of a serial device: the operation in progress and the requests waiting for it.
+ *
+ * Receiving and transmitting each have their own channel, so a pending READ does not hold up WRITEs.
+ */
+typedef struct dcb_channel {
+    int status;                   /**< DCB_IDLE, or DCB_READING / DCB_WRITING while an operation is in progress. */
+    int event_flag;               /**< Set when the operation in progress completes. */
+    char* buffer;                 /**< Caller's buffer for the operation in progress. */
+    size_t size;                  /**< Bytes of the buffer still to be transferred. */
+    struct iocb* iocb_queue_head; /**< Pointer to the head of this channel's IOCB queue. */
+    struct iocb* iocb_queue_tail; /**< Pointer to the tail of this channel's IOCB queue. */
+    struct iocb* active;          /**< Async request being carried out, NULL for a blocking one. */
+    struct pcb* owner;            /**< Process whose operation is in progress, NULL if none. */
+} dcb_channel;
+
 /** 
  * @brief Structure representing a Device Control Block (DCB).
  */
 typedef struct dcb {
     int open;                   /**< Whether the device is open (1 for open, 0 for closed). */
     device device_id;           /**< Identifier for the device. */
-    int event_flag;             /**< Event flag for signaling I/O completion. */
-    int status;                 /**< Status: idle, reading, or writing. */
-    char* input_buffer;         /**< Pointer to the current input buffer. */
-    char* output_buffer;        /**< Pointer to the current output buffer. */
-    size_t input_size;          /**< Size of the input buffer. */
-    size_t output_size;         /**< Size of the output buffer. */
-    char ring_buffer[256];      /**< Ring buffer for input storage. */
-    size_t ring_head;           /**< Head index for the ring buffer. */
-    size_t ring_tail;           /**< Tail index for the ring buffer. */
-    struct iocb* iocb_queue_head; /**< Pointer to the head of the IOCB queue. */
-    struct iocb* iocb_queue_tail; /**< Pointer to the tail of the IOCB queue. */
+    dcb_channel rx;             /**< Receive channel, used by READ. */
+    dcb_channel tx;             /**< Transmit channel, used by WRITE. */
+    unsigned char rx_trigger;   /**< Receive FIFO trigger level, one of SERIAL_RX_TRIGGER_*. */
+    char* ring_buffer;          /**< Ring buffer for input storage, ring_size bytes. */
+    size_t ring_size;           /**< Size of the ring buffer, a power of two. */
+    volatile size_t ring_head;  /**< Bytes ever stored in the ring buffer, only advanced by the ISR. */
+    volatile size_t ring_tail;  /**< Bytes ever taken from the ring buffer, only advanced by serial_tty(). */
+    size_t rx_dropped;          /**< Bytes of input lost because the ring buffer was full. */
+    int mode;                   /**< SERIAL_MODE_CANONICAL or SERIAL_MODE_RAW. */
+    int rx_timeout;             /**< Set by the ISR when the line went quiet after input (receive timeout). */
+    int rx_count;               /**< Length of the last completed read. */
+    struct iocb* iocb_pool;     /**< DCB_IOCB_POOL_SIZE IOCBs for requests queued on this device. */
+    struct iocb* iocb_free;     /**< Free IOCBs of the pool, linked through their next pointers. */
+    int iocb_available;         /**< Number of IOCBs on the free list. */
+    char tx_ring[SERIAL_TX_RING_SIZE]; /**< Output copied from writers, drained by the ISR. */
+    size_t tx_head;             /**< Index where the next byte of output is stored. */
+    size_t tx_tail;             /**< Index of the next byte to send. */
+    int escape_state;           /**< Escape sequence in progress: 0 none, 1 after ESC, 2 after ESC [. */
+    int edit_index;             /**< Cursor position in the line being read. */
+    int input_count;            /**< Characters in the line being read. */
 } dcb;
 
 /** 
@@ -115,12 +170,42 @@ int get_dcb_index(device dev);
 
 /**
  * @brief Opens the specified serial device with the given speed.
+ *
+ * The receive ring holds input until it is read. The ISR is its only producer and serial_tty() its
+ * only consumer, so neither side disables interrupts to use it.
  * 
  * @param dev The device to open.
  * @param speed The baud rate for the device.
+ * @param ring_size Size of the receive ring in bytes, a power of two (e.g. SERIAL_RX_RING_SIZE).
  * @return SUCCESS if successful, or an appropriate error code.
  */
-int serial_open(device dev, int speed);
+int serial_open(device dev, int speed, size_t ring_size);
+
+/**
+ * @brief Sets how many bytes the receive FIFO collects before raising an input interrupt.
+ *
+ * Input that stops short of the trigger level is still delivered by the receive timeout interrupt.
+ * In raw mode the level is kept and applied when the port goes back to canonical mode.
+ * 
+ * @param dev The device to configure.
+ * @param trigger One of SERIAL_RX_TRIGGER_1, _4, _8 or _14.
+ * @return SUCCESS if successful, or an appropriate error code.
+ */
+int serial_set_rx_trigger(device dev, unsigned char trigger);
+
+/**
+ * @brief Changes the settings of an open serial device.
+ *
+ * SERIAL_SET_MODE switches between canonical and raw mode and fails with ERR_DEVICE_BUSY while a
+ * read is in progress. In raw mode a read completes once it is full, or when the UART's receive
+ * timeout reports no input for about four character times after at least one byte.
+ * 
+ * @param dev The device to configure.
+ * @param command SERIAL_SET_MODE or SERIAL_SET_RX_TRIGGER.
+ * @param arg The new mode or trigger level.
+ * @return SUCCESS if successful, or an appropriate error code.
+ */
+int serial_ioctl(device dev, int command, int arg);
 
 /**
  * @brief Closes the specified serial device.
@@ -142,6 +227,10 @@ int serial_read(device dev, char* buf, size_t len);
 
 /**
  * @brief Writes data to the specified serial device.
+ *
+ * The data is copied into the port's transmit ring and sent in the background. The write is
+ * complete (event flag set) as soon as all of it has been copied; if the ring fills first, the rest
+ * is copied in by the ISR as space frees up.
  * 
  * @param dev The device to write to.
  * @param buf Pointer to the buffer containing data to write.
@@ -152,10 +241,25 @@ int serial_write(device dev, char* buf, size_t len);
 
 /**
  * @brief Handles serial input interrupts for a specified DCB.
+ *
+ * Only drains the receive FIFO into the ring buffer; echo and editing are left to serial_tty().
  * 
  * @param dcb Pointer to the DCB handling the input interrupt.
+ * @param timeout Non-zero if the UART reported a receive timeout rather than data at the trigger level.
+ */
+void serial_input_interrupt(struct dcb* dcb, int timeout);
+
+/**
+ * @brief Runs the line discipline for a specified DCB.
+ *
+ * Edits received input into the read in progress and echoes it, or in raw mode copies it as it is.
+ * Called at dispatch rather than
+ * from the ISR, so editing and echo never run with the serial interrupt held off.
+ * 
+ * @param dcb Pointer to the DCB whose input is processed.
+ * @return Length of the line if the read completed, otherwise -1.
  */
-void serial_input_interrupt(struct dcb* dcb);
+int serial_tty(struct dcb* dcb);
 
 /**
  * @brief Handles serial output interrupts for a specified DCB.
@@ -166,6 +270,9 @@ void serial_output_interrupt(struct dcb* dcb);
 
 /**
  * @brief Handles serial device interrupts.
+ *
+ * Installed on both serial IRQ lines. Every open port is serviced until none has an interrupt
+ * pending, so ports sharing a line (or both lines firing together) are all handled in one pass.
  */
 void serial_interrupt(void);
 
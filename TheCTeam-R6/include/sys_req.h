@@ -13,7 +13,27 @@ typedef enum {
 	IDLE,
 	READ,
 	WRITE,
+	IOCTL,
+	READ_ASYNC,
+	WRITE_ASYNC,
+	POLL,
+	WAIT,
+	SELECT,
 } op_code;
+
+/** SELECT event: input is waiting and no READ is in progress on the device */
+#define SELECT_READ		0x1
+/** SELECT event: no WRITE is in progress and the device has room for output */
+#define SELECT_WRITE	0x2
+
+/**
+ One device watched by a SELECT request
+*/
+struct select_entry {
+	device dev;	/**< Device to watch */
+	int events;	/**< SELECT_READ and/or SELECT_WRITE */
+	int revents;	/**< Set by SELECT to the events that are ready */
+};
     
 // error codes
 #define INVALID_OPERATION	(-1)
@@ -22,9 +42,12 @@ typedef enum {
 
 /**
  Request an MPX kernel operation.
- @param op_code One of READ, WRITE, IDLE, or EXIT
- @param ... As required for READ or WRITE
- @return Varies by operation
+ @param op_code One of READ, WRITE, READ_ASYNC, WRITE_ASYNC, POLL, WAIT, SELECT, IOCTL, IDLE, or EXIT
+ @param ... As required for READ, WRITE and the async variants (device, buffer, length),
+            POLL or WAIT (request handle), SELECT (struct select_entry array, entry count)
+            or IOCTL (device, command, argument)
+ @return Varies by operation; READ_ASYNC and WRITE_ASYNC return a request handle,
+         SELECT the index of the first ready entry
 */ 
 int sys_req(op_code op, ...);
  
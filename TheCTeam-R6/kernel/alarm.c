@@ -112,7 +112,7 @@ void create_alarm(char* time, char* message){
     char* current_time = get_time();
 
     alarm_store(time, message);
-    pcb* alarm1 = pcb_setup(current_time, USER_PROCESS, 8);
+    pcb* alarm1 = pcb_setup(current_time, USER_PROCESS, 8, PCB_DEFAULT_STACK_SIZE);
     initialize_context(alarm1, alarm_process, 0);
     sys_free_mem(current_time);
 }
@@ -10,6 +10,8 @@
 
 bits 32
 global start
+global multiboot_magic
+global multiboot_info
 extern kmain
 
 ;; GRUB style multiboot header
@@ -32,6 +34,8 @@ multiboot_header:
 ;; kernel entry point
 start:
 	mov esp, stack + STACKSIZE	;; establish a stack
+	mov [multiboot_magic], eax	;; keep what the loader passed in
+	mov [multiboot_info], ebx
 	call kmain			;; jump to C code
 
 	cli				;; disable interrupts
@@ -47,3 +51,5 @@ start:
 section .bss
 align 4
 stack:	resb STACKSIZE	; reserve stack on doubleword boundary
+multiboot_magic:	resd 1
+multiboot_info:	resd 1
@@ -58,6 +58,7 @@ void gdt_init(void)
 #include <mpx/panic.h>
 #include <mpx/interrupts.h>
 #include <mpx/io.h>
+#include <mpx/vm.h>
 
 #define REQUIRED_INTERRUPTS	(32)
 
@@ -119,10 +120,20 @@ simple_isr(invalid_tss, "Invalid TSS")
 simple_isr(segment_not_present, "Segment not present")
 simple_isr(stack_segment, "Stack segment error")
 simple_isr(general_protection, "General protection fault")
-simple_isr(page_fault, "Page Fault")
 simple_isr(reserved, "Reserved")
 simple_isr(coprocessor, "Coprocessor error")
 
+/* The CPU pushes an error code for page faults, and CR2 holds the faulting address */
+static __attribute__((interrupt)) void page_fault(void *int_frame, unsigned int error_code)
+{
+	(void)int_frame;
+	uintptr_t addr;
+	__asm__ volatile ("mov %%cr2,%0" : "=r"(addr));
+	if (vm_page_fault(addr, error_code) != 0) {
+		kpanic("Page Fault");
+	}
+}
+
 static __attribute__((interrupt)) void rtc_isr(void *int_frame)
 {
 	(void)int_frame;
@@ -175,7 +186,7 @@ void irq_init(void)
 		segment_not_present,
 		stack_segment,
 		general_protection,
-		page_fault,
+		(isr_function)(uintptr_t)page_fault,	// takes an error code as well
 		reserved,
 		coprocessor,
 	};
@@ -241,30 +252,64 @@ noreturn void kpanic(const char *msg)
  * ************************************************************************/
 #include <mpx/panic.h>
 #include <mpx/vm.h>
+#include <mpx/multiboot.h>
 #include <limits.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // The physical start of the heap
 // TODO: this is very magic
 #define KHEAP_BASE	0xD000000
 
-// The size of the primitive kernel heap
-#define KHEAP_SIZE	0x10000
-
 // 4 KB pages
 #define PAGE_SIZE	0x1000
 
-// 64 MB total memory
-// TODO: learn this from boot parameters
-#define MEM_SIZE	0x4000000
+// Virtual space reserved for the kernel heap; pages are backed on demand
+#define KHEAP_MAX	0x400000
+#define KHEAP_PAGES	(KHEAP_MAX / PAGE_SIZE)
 
-// number of frames
-#define NFRAMES		(MEM_SIZE / PAGE_SIZE)
+// Virtual space reserved for process stacks, each with a guard page below it
+#define STACK_BASE	0xE000000
+#define STACK_MAX	0x400000
+#define STACK_PAGES	(STACK_MAX / PAGE_SIZE)
+
+// Page used to map frames while they are zeroed, just below the kernel heap
+#define ZERO_WINDOW	(KHEAP_BASE - PAGE_SIZE)
+
+// Frames kept zeroed ahead of time, and how many are zeroed per idle pass
+#define ZERO_POOL_SIZE	32
+#define ZERO_BATCH	4
+
+// memory assumed present when the loader provides no memory information
+#define DEFAULT_MEM_SIZE	0x4000000
 
 // bits per frame
 #define FRAME_BIT	(sizeof(uint32_t) * CHAR_BIT)
 
+// largest buddy block is 2^BUDDY_MAX_ORDER pages, which is also the pool size (4 MB)
+#define BUDDY_MAX_ORDER	10
+#define BUDDY_FRAMES	(1 << BUDDY_MAX_ORDER)
+#define BUDDY_SIZE	(BUDDY_FRAMES * PAGE_SIZE)
+
+// 4 MB pages, available when the CPU supports PSE
+#define LARGE_PAGE_SIZE	0x400000
+
+// map_range() flags, matching the low bits of a page table entry
+#define PTE_PRESENT	0x1
+#define PTE_WRITE	0x2
+#define PTE_USER	0x4
+
+// map_range() flag: use 4 MB pages where the range allows it (the PS bit)
+#define MAP_LARGE	0x80
+
+// the global bit of a 4 MB directory entry
+#define PDE_GLOBAL	0x100
+
+// marks an empty list, or a frame that does not start a free block
+#define BUDDY_NONE	0xFFFF
+#define BUDDY_NOT_FREE	0xFF
+
 /*
   Page entry structure
   Describes a single page in memory
@@ -273,9 +318,13 @@ typedef struct {
 	uint32_t present:1;
 	uint32_t writeable:1;
 	uint32_t usermode:1;
+	uint32_t writethrough:1;
+	uint32_t nocache:1;
 	uint32_t accessed:1;
 	uint32_t dirty:1;
-	uint32_t reserved:7;
+	uint32_t pat:1;
+	uint32_t global:1;	// kept in the TLB across CR3 loads when CR4.PGE is set
+	uint32_t available:3;
 	uint32_t frameaddr:20;
 } page_entry;
 
@@ -296,8 +345,13 @@ typedef struct {
 	uint32_t tables_phys[1024];
 } page_dir;
 
-// bitmap of frames
-static uint32_t frames[NFRAMES / FRAME_BIT] = { 0 };
+// bitmap of frames, sized from the boot memory map; a set bit is a frame
+// that is in use or is not usable RAM
+static uint32_t *frames;
+
+// number of frames the bitmap covers, and the words it takes
+static uint32_t nframes;
+static uint32_t nframe_words;
 
 // kernel page directory
 static page_dir *kdir;
@@ -312,18 +366,107 @@ static uintptr_t phys_alloc_addr = (uintptr_t) & __end;
 // if 0, allocate physical memory, otherwise virtual
 static int heap_is_initialized = 0;
 
-static uint32_t alloc(uint32_t size)
+// non-zero once CR4.PSE is set and 4 MB pages can be used
+static int pse_enabled = 0;
+
+// non-zero once CR4.PGE is set and kernel pages are marked global
+static int pge_enabled = 0;
+
+// the page directory CR3 currently points at
+static uint32_t current_space = 0;
+
+static uint32_t alloc(uint32_t size);
+static void back_page(uintptr_t addr);
+
+/*
+  Buddy allocator state
+  The pool is a BUDDY_SIZE run of identity-mapped frames. Free blocks are
+  kept on one doubly linked list per order, linked by frame index so no
+  bookkeeping lives in the pool itself.
+*/
+static uintptr_t buddy_base = 0;
+static uint16_t buddy_head[BUDDY_MAX_ORDER + 1];
+static uint16_t buddy_next[BUDDY_FRAMES];
+static uint16_t buddy_prev[BUDDY_FRAMES];
+static uint8_t buddy_order[BUDDY_FRAMES];
+
+/* Puts the block starting at frame idx on the free list for its order */
+static void buddy_push(uint32_t idx, uint32_t order)
 {
-	static uint32_t heap_addr = KHEAP_BASE;
+	buddy_order[idx] = order;
+	buddy_prev[idx] = BUDDY_NONE;
+	buddy_next[idx] = buddy_head[order];
+	if (buddy_head[order] != BUDDY_NONE) {
+		buddy_prev[buddy_head[order]] = idx;
+	}
+	buddy_head[order] = idx;
+}
 
-	uint32_t base = heap_addr;
-	heap_addr += size;
+/* Takes the block starting at frame idx off its free list */
+static void buddy_unlink(uint32_t idx)
+{
+	uint32_t order = buddy_order[idx];
 
-	if (heap_addr > KHEAP_BASE + KHEAP_SIZE) {
-		kpanic("Heap is full!");
+	if (buddy_prev[idx] != BUDDY_NONE) {
+		buddy_next[buddy_prev[idx]] = buddy_next[idx];
+	} else {
+		buddy_head[order] = buddy_next[idx];
+	}
+	if (buddy_next[idx] != BUDDY_NONE) {
+		buddy_prev[buddy_next[idx]] = buddy_prev[idx];
 	}
+	buddy_order[idx] = BUDDY_NOT_FREE;
+}
 
-	return base;
+void *alloc_pages(unsigned int order)
+{
+	if (buddy_base == 0 || order > BUDDY_MAX_ORDER) {
+		return NULL;
+	}
+
+	// smallest order with a free block
+	uint32_t found = order;
+	while (found <= BUDDY_MAX_ORDER && buddy_head[found] == BUDDY_NONE) {
+		found++;
+	}
+	if (found > BUDDY_MAX_ORDER) {
+		return NULL;
+	}
+
+	uint32_t idx = buddy_head[found];
+	buddy_unlink(idx);
+
+	// split, keeping the lower half and freeing the upper half each time
+	while (found > order) {
+		found--;
+		buddy_push(idx + (1 << found), found);
+	}
+
+	return (void *)(buddy_base + idx * PAGE_SIZE);
+}
+
+void free_pages(void *addr, unsigned int order)
+{
+	uintptr_t offset = (uintptr_t) addr - buddy_base;
+	uint32_t idx = offset / PAGE_SIZE;
+
+	if (buddy_base == 0 || (uintptr_t) addr < buddy_base || offset >= BUDDY_SIZE
+	    || order > BUDDY_MAX_ORDER || (idx & ((1 << order) - 1)) != 0) {
+		kpanic("free_pages: bad block");
+	}
+
+	// merge with the buddy for as long as it is free and the same order
+	while (order < BUDDY_MAX_ORDER) {
+		uint32_t buddy = idx ^ (1 << order);
+		if (buddy_order[buddy] != order) {
+			break;
+		}
+		buddy_unlink(buddy);
+		idx &= ~(1 << order);
+		order++;
+	}
+
+	buddy_push(idx, order);
 }
 
 /*
@@ -339,11 +482,24 @@ static page_entry *get_page(uint32_t addr, page_dir * dir, int make_table)
 		return &dir->tables[index]->pages[offset];
 	}
 
+	// covered by a 4 MB page, so there is no page entry to return
+	if (dir->tables_phys[index] & 0x80) {
+		return NULL;
+	}
+
 	// create it if necessary
 	if (make_table) {
 		void *phys_addr = NULL;
-		dir->tables[index] =
-		    (page_table *) kmalloc(sizeof(page_table), 1, &phys_addr);
+		// once paging is on, tables come from the identity-mapped buddy pool
+		page_table *table = alloc_pages(0);
+		if (table != NULL) {
+			phys_addr = table;
+		} else {
+			table = (page_table *) kmalloc(sizeof(page_table), 1, &phys_addr);
+		}
+		// demand-zero faulting and the stack guard pages rely on unused entries not being present
+		memset(table, 0, sizeof(*table));
+		dir->tables[index] = table;
 		dir->tables_phys[index] = ((uintptr_t) phys_addr) | 0x7;	//enable present, writable
 		return &dir->tables[index]->pages[offset];
 	}
@@ -359,6 +515,8 @@ void *kmalloc(uint32_t size, int page_align, void **phys_addr)
 	if (heap_is_initialized) {
 		addr = (void *)alloc(size);
 		if (phys_addr) {
+			// the caller needs a real frame now, not on first touch
+			back_page((uintptr_t) addr);
 			page_entry *page = get_page((uint32_t) addr, kdir, 0);
 			*phys_addr =
 			    (void *)((page->frameaddr * 0x1000) +
@@ -380,16 +538,25 @@ void *kmalloc(uint32_t size, int page_align, void **phys_addr)
 	return addr;
 }
 
-/* Finds the first free page frame */
+// all frames below this index are known to be in use
+static uint32_t next_free_hint = 0;
+
+/*
+ Finds the first free page frame, starting the search at the hint and
+ testing a whole bitmap word at a time.
+*/
 static uint32_t find_free(void)
 {
-	uint32_t i, j;
-	for (i = 0; i < NFRAMES / FRAME_BIT; i++)
-		if (frames[i] != 0xFFFFFFFF)	//if frame not full
-			for (j = 0; j < FRAME_BIT; j++)	//find first free bit
-				if (!(frames[i] & (1 << j)))
-					return i * FRAME_BIT + j;
+	for (uint32_t i = next_free_hint / FRAME_BIT; i < nframe_words; i++) {
+		if (frames[i] != 0xFFFFFFFF) {	//if frame not full
+			//lowest clear bit is the first free frame in this word
+			uint32_t frame = i * FRAME_BIT + __builtin_ctz(~frames[i]);
+			next_free_hint = frame;
+			return frame;
+		}
+	}
 
+	next_free_hint = nframes;
 	return -1;		//no free frames
 }
 
@@ -397,11 +564,41 @@ static uint32_t find_free(void)
 static void set_bit(uint32_t addr)
 {
 	uint32_t frame = addr / PAGE_SIZE;
+	if (frame >= nframes) {
+		return;
+	}
 	uint32_t index = frame / FRAME_BIT;
 	uint32_t offset = frame % FRAME_BIT;
 	frames[index] |= (1 << offset);
 }
 
+/* Marks a page frame bit as free and lowers the search hint */
+static void clear_bit(uint32_t addr)
+{
+	uint32_t frame = addr / PAGE_SIZE;
+	if (frame >= nframes) {
+		return;
+	}
+	uint32_t index = frame / FRAME_BIT;
+	uint32_t offset = frame % FRAME_BIT;
+	frames[index] &= ~(1 << offset);
+
+	if (frame < next_free_hint) {
+		next_free_hint = frame;
+	}
+}
+
+/*
+  Pre-zeroed frame pool
+  Frames in the pool are already marked in use in the bitmap and contain
+  only zeroes. vm_prezero_frames() fills it while the system is idle.
+  Page tables do not come from the pool; get_page() clears each new one,
+  whether it is taken from the bump heap before paging is on or from the
+  buddy pool afterwards.
+*/
+static uint32_t zeroed_frames[ZERO_POOL_SIZE];
+static uint32_t zeroed_count = 0;
+
 /*
  Marks a frame as in use in the frame bitmap, sets up the page,
  and saves the frame index in the page.
@@ -414,7 +611,11 @@ static void new_frame(page_entry * page)
 
 	uint32_t index = find_free();
 	if (index == (uint32_t) (-1)) {
-		kpanic("Out of memory");
+		// last resort: the frames set aside for the zeroed pool
+		if (zeroed_count == 0) {
+			kpanic("Out of memory");
+		}
+		index = zeroed_frames[--zeroed_count];
 	}
 
 	//mark a frame as in-use
@@ -423,37 +624,544 @@ static void new_frame(page_entry * page)
 	page->frameaddr = index;
 	page->writeable = 1;
 	page->usermode = 0;
+	page->global = pge_enabled;
+}
+
+/*
+ Returns the frame behind a page to the bitmap and marks the page
+ not present.
+*/
+static void free_frame(page_entry * page)
+{
+	if (page->frameaddr == 0) {
+		return;
+	}
+
+	clear_bit(page->frameaddr * PAGE_SIZE);
+	page->present = 0;
+	page->frameaddr = 0;
+}
+
+/*
+  Demand-paged virtual region
+  A set bit in used means the page is reserved, though it may not be
+  backed by a frame yet. run holds the length in pages of each
+  reservation at its first page, and 0 everywhere else.
+*/
+typedef struct {
+	uint32_t base;
+	uint32_t npages;
+	uint32_t *used;
+	uint16_t *run;
+	uint32_t hint;		// all pages below this index are known to be in use
+} vm_region;
+
+static uint32_t kheap_used[KHEAP_PAGES / FRAME_BIT];
+static uint16_t kheap_run[KHEAP_PAGES];
+static vm_region kheap = { KHEAP_BASE, KHEAP_PAGES, kheap_used, kheap_run, 0 };
+
+static uint32_t stack_used[STACK_PAGES / FRAME_BIT];
+static uint16_t stack_run[STACK_PAGES];
+static vm_region stacks = { STACK_BASE, STACK_PAGES, stack_used, stack_run, 0 };
+
+static int region_test(const vm_region * region, uint32_t page)
+{
+	return region->used[page / FRAME_BIT] & (1 << (page % FRAME_BIT));
+}
+
+/*
+ Reserves npages contiguous pages in a region, first fit. Returns the
+ address of the first page, or 0 if there is no room. The pages are only
+ reserved here; in the kernel heap vm_page_fault() backs each one with a
+ zeroed frame the first time it is touched.
+*/
+static uint32_t region_reserve(vm_region * region, uint32_t npages)
+{
+	uint32_t start = region->hint, length = 0;
+	for (uint32_t page = region->hint; page < region->npages && length < npages; page++) {
+		if (region_test(region, page)) {
+			start = page + 1;
+			length = 0;
+		} else {
+			length++;
+		}
+	}
+	if (length < npages) {
+		return 0;
+	}
+
+	for (uint32_t page = start; page < start + npages; page++) {
+		region->used[page / FRAME_BIT] |= (1 << (page % FRAME_BIT));
+	}
+	region->run[start] = npages;
+
+	if (start == region->hint) {
+		region->hint = start + npages;
+	}
+
+	return region->base + start * PAGE_SIZE;
+}
+
+/*
+ Releases a reservation made by region_reserve(), returning the frames
+ behind any pages that were touched. Returns -1 if addr is not the start
+ of a reservation in the region.
+*/
+static int region_release(vm_region * region, void *addr)
+{
+	uintptr_t offset = (uintptr_t) addr - region->base;
+	uint32_t start = offset / PAGE_SIZE;
+
+	if ((uintptr_t) addr < region->base || start >= region->npages
+	    || (offset % PAGE_SIZE) != 0 || region->run[start] == 0) {
+		return -1;
+	}
+
+	for (uint32_t page = start; page < start + region->run[start]; page++) {
+		region->used[page / FRAME_BIT] &= ~(1 << (page % FRAME_BIT));
+		vm_free_page((void *)(region->base + page * PAGE_SIZE));
+	}
+	region->run[start] = 0;
+
+	if (start < region->hint) {
+		region->hint = start;
+	}
+
+	return 0;
+}
+
+/* Returns non-zero if addr lies in a reserved page of the region that may be backed */
+static int region_backable(const vm_region * region, uintptr_t addr)
+{
+	if (addr < region->base || addr - region->base >= region->npages * PAGE_SIZE) {
+		return 0;
+	}
+
+	uint32_t page = (addr - region->base) / PAGE_SIZE;
+	return region_test(region, page);
+}
+
+/* Allocates whole pages from the kernel heap. Always page aligned. */
+static uint32_t alloc(uint32_t size)
+{
+	uint32_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0) {
+		npages = 1;
+	}
+
+	uint32_t addr = region_reserve(&kheap, npages);
+	if (addr == 0) {
+		kpanic("Heap is full!");
+	}
+	return addr;
+}
+
+int kfree(void *addr)
+{
+	// only the start of a live allocation can be freed
+	return region_release(&kheap, addr);
+}
+
+void *vm_alloc_stack(size_t size)
+{
+	// one extra page at the bottom is left unmapped as the guard
+	uint32_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE + 1;
+
+	uint32_t addr = region_reserve(&stacks, npages);
+	if (addr == 0) {
+		return NULL;
+	}
+
+	/*
+	 Processes run in ring 0, where a fault does not switch stacks: the CPU
+	 would push the #PF frame onto the very page that is missing. So the
+	 stack cannot be demand paged and every page but the guard is backed now.
+	*/
+	for (uint32_t page = 1; page < npages; page++) {
+		if (zeroed_count == 0 && find_free() == (uint32_t) (-1)) {
+			region_release(&stacks, (void *)addr);
+			return NULL;
+		}
+		back_page(addr + page * PAGE_SIZE);
+	}
+	return (void *)(addr + PAGE_SIZE);
+}
+
+void vm_free_stack(void *stack)
+{
+	if (stack != NULL) {
+		region_release(&stacks, (char *)stack - PAGE_SIZE);
+	}
+}
+
+/*
+ Maps a zeroed frame behind a reserved page that is not yet backed,
+ taking it from the pre-zeroed pool when there is one.
+*/
+static void back_page(uintptr_t addr)
+{
+	page_entry *page = get_page(addr, kdir, 0);
+	if (page->present) {
+		return;
+	}
+
+	if (zeroed_count > 0) {
+		page->present = 1;
+		page->frameaddr = zeroed_frames[--zeroed_count];
+		page->writeable = 1;
+		page->usermode = 0;
+		page->global = pge_enabled;
+		return;
+	}
+
+	new_frame(page);
+	memset((void *)(addr & ~(uintptr_t)(PAGE_SIZE - 1)), 0, PAGE_SIZE);
+}
+
+void vm_prezero_frames(void)
+{
+	page_entry *window = get_page(ZERO_WINDOW, kdir, 0);
+
+	for (int i = 0; i < ZERO_BATCH && zeroed_count < ZERO_POOL_SIZE; i++) {
+		uint32_t index = find_free();
+		if (index == (uint32_t) (-1)) {
+			return;
+		}
+		set_bit(index * PAGE_SIZE);
+
+		// map the frame through the window just long enough to clear it
+		window->present = 1;
+		window->writeable = 1;
+		window->frameaddr = index;
+		__asm__ volatile ("invlpg (%0)" :: "r"(ZERO_WINDOW) : "memory");
+		memset((void *)ZERO_WINDOW, 0, PAGE_SIZE);
+		window->present = 0;
+		window->frameaddr = 0;
+		__asm__ volatile ("invlpg (%0)" :: "r"(ZERO_WINDOW) : "memory");
+
+		zeroed_frames[zeroed_count++] = index;
+	}
+}
+
+int vm_page_fault(uintptr_t addr, uint32_t error_code)
+{
+	// protection violations are real faults, only missing pages are backed
+	if (error_code & 0x1) {
+		return -1;
+	}
+
+	// stacks are backed when they are allocated, see vm_alloc_stack()
+	if (region_backable(&kheap, addr)) {
+		back_page(addr);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Frees the frames lying entirely inside [base, base + len) */
+static void frames_release(uint64_t base, uint64_t len)
+{
+	uint64_t first = (base + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint64_t last = (base + len) / PAGE_SIZE;
+	if (last > nframes) {
+		last = nframes;
+	}
+
+	for (uint64_t frame = first; frame < last; frame++) {
+		frames[frame / FRAME_BIT] &= ~(1 << (frame % FRAME_BIT));
+	}
+}
+
+/* Returns non-zero if every frame in [base, base + len) is free */
+static int frames_free(uint32_t base, uint32_t len)
+{
+	for (uint32_t addr = base; addr < base + len; addr += PAGE_SIZE) {
+		uint32_t frame = addr / PAGE_SIZE;
+		if (frame >= nframes || (frames[frame / FRAME_BIT] & (1 << (frame % FRAME_BIT)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ Sizes the frame bitmap from the memory information the Multiboot loader
+ left behind, then frees only the frames the memory map reports as usable
+ RAM. Memory above 4 GB is ignored.
+*/
+static void frames_init(void)
+{
+	const struct multiboot_info *info =
+	    multiboot_magic == MULTIBOOT_BOOTLOADER_MAGIC ? multiboot_info : NULL;
+	uint64_t top = DEFAULT_MEM_SIZE;
+
+	// find the end of usable memory
+	if (info && (info->flags & MULTIBOOT_INFO_MEM_MAP)) {
+		top = 0;
+		for (uint32_t off = 0; off < info->mmap_length;) {
+			const struct multiboot_mmap_entry *entry =
+			    (void *)(info->mmap_addr + off);
+			if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr + entry->len > top) {
+				top = entry->addr + entry->len;
+			}
+			off += entry->size + sizeof(entry->size);
+		}
+	} else if (info && (info->flags & MULTIBOOT_INFO_MEMORY)) {
+		top = 0x100000 + (uint64_t) info->mem_upper * 1024;
+	}
+	if (top > 0x100000000ULL) {
+		top = 0x100000000ULL;
+	}
+
+	nframes = top / PAGE_SIZE;
+	nframe_words = (nframes + FRAME_BIT - 1) / FRAME_BIT;
+	frames = kmalloc(nframe_words * sizeof(*frames), 0, NULL);
+
+	// everything starts out in use; then free what is known to be RAM
+	memset(frames, 0xFF, nframe_words * sizeof(*frames));
+	if (info && (info->flags & MULTIBOOT_INFO_MEM_MAP)) {
+		for (uint32_t off = 0; off < info->mmap_length;) {
+			const struct multiboot_mmap_entry *entry =
+			    (void *)(info->mmap_addr + off);
+			if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+				frames_release(entry->addr, entry->len);
+			}
+			off += entry->size + sizeof(entry->size);
+		}
+	} else if (info && (info->flags & MULTIBOOT_INFO_MEMORY)) {
+		frames_release(0, (uint64_t) info->mem_lower * 1024);
+		frames_release(0x100000, (uint64_t) info->mem_upper * 1024);
+	} else {
+		frames_release(0, top);
+	}
+}
+
+/*
+ Turns on 4 MB pages (PSE) and global pages (PGE) for whichever of them
+ CPUID reports. Must run before any mappings are made.
+*/
+static void paging_features_init(void)
+{
+	uint32_t eax = 1, ebx, ecx, edx;
+	__asm__ volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+	uint32_t cr4;
+	__asm__ volatile ("mov %%cr4,%0" : "=r"(cr4));
+	if (edx & (1 << 3)) {
+		cr4 |= (1 << 4);
+		pse_enabled = 1;
+	}
+	if (edx & (1 << 13)) {
+		cr4 |= (1 << 7);
+		pge_enabled = 1;
+	}
+	__asm__ volatile ("mov %0,%%cr4" :: "r"(cr4));
+}
+
+/*
+ Maps len bytes at virt onto the frames at phys and marks those frames in
+ use. Each page table is looked up once and its entries filled in a
+ single pass. Without PTE_PRESENT, only the page tables are created and
+ the entries are left for vm_page_fault() to fill. With MAP_LARGE and PSE,
+ 4 MB aligned stretches use one directory entry and no page table.
+*/
+static void map_range(uint32_t virt, uint32_t phys, uint32_t len, uint32_t flags)
+{
+	uint32_t end = virt + len;
+
+	while (virt < end) {
+		uint32_t index = virt / LARGE_PAGE_SIZE;
+		uint32_t table_end = (index + 1) * LARGE_PAGE_SIZE;
+		if (table_end == 0 || table_end > end) {
+			table_end = end;
+		}
+
+		if ((flags & MAP_LARGE) && (flags & PTE_PRESENT) && pse_enabled
+		    && virt % LARGE_PAGE_SIZE == 0 && phys % LARGE_PAGE_SIZE == 0
+		    && end - virt >= LARGE_PAGE_SIZE) {
+			kdir->tables[index] = NULL;
+			kdir->tables_phys[index] = phys | (flags & (PTE_PRESENT | PTE_WRITE | PTE_USER)) | MAP_LARGE
+			    | (pge_enabled ? PDE_GLOBAL : 0);
+			for (uint32_t frame = phys; frame < phys + LARGE_PAGE_SIZE; frame += PAGE_SIZE) {
+				set_bit(frame);
+			}
+		} else {
+			page_entry *page = get_page(virt, kdir, 1);
+			if (flags & PTE_PRESENT) {
+				page_entry entry = {
+					.present = 1,
+					.writeable = (flags & PTE_WRITE) != 0,
+					.usermode = (flags & PTE_USER) != 0,
+					.global = pge_enabled,
+					.frameaddr = phys / PAGE_SIZE,
+				};
+				for (uint32_t addr = virt; addr < table_end; addr += PAGE_SIZE) {
+					set_bit(entry.frameaddr * PAGE_SIZE);
+					*page++ = entry;
+					entry.frameaddr++;
+				}
+			}
+		}
+
+		phys += table_end - virt;
+		virt = table_end;
+	}
+}
+
+/*
+ Carves the buddy pool out of the frame bitmap at base and identity-maps
+ it, then hands the whole pool to the allocator as one top-order block.
+*/
+static void buddy_init(uintptr_t base)
+{
+	map_range(base, base, BUDDY_SIZE, PTE_PRESENT | PTE_WRITE | MAP_LARGE);
+
+	memset(buddy_order, BUDDY_NOT_FREE, sizeof(buddy_order));
+	for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+		buddy_head[i] = BUDDY_NONE;
+	}
+	buddy_push(0, BUDDY_MAX_ORDER);
+	buddy_base = base;
+}
+
+void vm_free_page(void *addr)
+{
+	page_entry *page = get_page((uint32_t) addr, kdir, 0);
+	if (page == NULL) {
+		return;
+	}
+
+	free_frame(page);
+	__asm__ volatile ("invlpg (%0)" :: "r"(addr) : "memory");
+}
+
+uint32_t vm_create_space(void)
+{
+	// two pages, so that tables_phys (what CR3 points at) is page aligned
+	page_dir *dir = alloc_pages(1);
+	if (dir == NULL) {
+		return 0;
+	}
+
+	// every kernel page table is shared; all of them exist once vm_init() is done
+	memcpy(dir, kdir, sizeof(*dir));
+	return (uint32_t) & dir->tables_phys[0];
+}
+
+void vm_destroy_space(uint32_t space)
+{
+	if (space == 0) {
+		return;
+	}
+
+	// never free the directory the CPU is still walking
+	if (current_space == space) {
+		vm_switch_space(0);
+	}
+	free_pages((void *)(space - offsetof(page_dir, tables_phys)), 1);
+}
+
+void vm_switch_space(uint32_t space)
+{
+	if (space == 0) {
+		space = (uint32_t) & kdir->tables_phys[0];
+	}
+
+	// reloading CR3 flushes every non-global TLB entry, so skip it when nothing changes
+	if (space != current_space) {
+		current_space = space;
+		__asm__ volatile ("mov %0,%%cr3" :: "r"(space) : "memory");
+	}
+}
+
+// kernel image pages touched after each switch in vm_bench_switch()
+#define BENCH_PAGES	16
+
+uint32_t vm_bench_switch(int global, uint32_t iterations)
+{
+	uint32_t other = vm_create_space();
+	if (other == 0 || iterations == 0) {
+		vm_destroy_space(other);
+		return 0;
+	}
+	uint32_t kernel = (uint32_t) & kdir->tables_phys[0];
+	uint32_t saved = current_space;
+
+	// with CR4.PGE clear the global bits are ignored and every CR3 load flushes everything
+	uint32_t cr4;
+	__asm__ volatile ("mov %%cr4,%0" : "=r"(cr4));
+	if (pge_enabled && !global) {
+		__asm__ volatile ("mov %0,%%cr4" :: "r"(cr4 & ~(1 << 7)) : "memory");
+	}
+
+	uint32_t start, end, hi;
+	__asm__ volatile ("rdtsc" : "=a"(start), "=d"(hi));
+	for (uint32_t i = 0; i < iterations; i++) {
+		vm_switch_space((i & 1) ? other : kernel);
+
+		// touch the kernel image the way a dispatch would, paying for any TLB misses
+		for (uint32_t page = 0; page < BENCH_PAGES; page++) {
+			(void)*(volatile uint8_t *)(0x100000 + page * PAGE_SIZE);
+		}
+	}
+	__asm__ volatile ("rdtsc" : "=a"(end), "=d"(hi));
+
+	__asm__ volatile ("mov %0,%%cr4" :: "r"(cr4) : "memory");
+	vm_switch_space(saved);
+	vm_destroy_space(other);
+
+	return (end - start) / iterations;
 }
 
 void vm_init(void)
 {
+	paging_features_init();
+	frames_init();
+
 	// create kernel directory
 	kdir = kmalloc(sizeof(*kdir), 1, 0);	//page aligned
 	memset(kdir, 0, sizeof(*kdir));
 
-	// get pages for kernel heap
-	for (uint32_t i = KHEAP_BASE; i < (KHEAP_BASE + KHEAP_SIZE); i += 1) {
-		get_page(i, kdir, 1);
+	// create the page tables for the kernel heap and stacks up front, so that
+	// backing a heap page later never has to allocate
+	map_range(KHEAP_BASE, 0, KHEAP_MAX, 0);
+	map_range(STACK_BASE, 0, STACK_MAX, 0);
+	map_range(ZERO_WINDOW, 0, PAGE_SIZE, 0);
+
+	// place the buddy pool on the first 4 MB boundary past the kernel,
+	// leaving room for the page tables still to be allocated below it;
+	// without enough RAM there, page tables keep coming from the kernel heap
+	uintptr_t pool = (phys_alloc_addr + 0x20000 + BUDDY_SIZE - 1) & ~(uintptr_t)(BUDDY_SIZE - 1);
+	if (frames_free(pool, BUDDY_SIZE)) {
+		buddy_init(pool);
 	}
 
 	// perform identity mapping of used memory
 	// note: placement_addr gets incremented in get_page,
 	// so we're mapping the first frames as well
-	for (uint32_t i = 0; i < (phys_alloc_addr + 0x10000); i += PAGE_SIZE) {
-		new_frame(get_page(i, kdir, 1));
+	// the first 4 MB always uses 4 KB pages so that page 0 can be unmapped;
+	// past that, whole 4 MB blocks get large pages and the tail short of a
+	// 4 MB boundary gets 4 KB pages, so no frames beyond it are claimed
+	uint32_t identity_end = phys_alloc_addr + 0x10000;
+	if (identity_end <= LARGE_PAGE_SIZE) {
+		map_range(0, 0, identity_end, PTE_PRESENT | PTE_WRITE);
+	} else {
+		map_range(0, 0, LARGE_PAGE_SIZE, PTE_PRESENT | PTE_WRITE);
+		map_range(LARGE_PAGE_SIZE, LARGE_PAGE_SIZE, identity_end - LARGE_PAGE_SIZE,
+			  PTE_PRESENT | PTE_WRITE | MAP_LARGE);
 	}
 
-	// allocate heap frames now that the placement addr has increased.
-	// placement addr increases here for heap
-	for (uint32_t i = KHEAP_BASE; i < (KHEAP_BASE + KHEAP_SIZE); i += PAGE_SIZE) {
-		new_frame(get_page(i, kdir, 1));
+	if (buddy_base != 0 && phys_alloc_addr + 0x10000 > pool) {
+		kpanic("Kernel image overlaps the buddy pool");
 	}
 
 	// generate a page fault for NULL pointer dereference
 	memset(&kdir->tables[0]->pages[0], 0, sizeof(kdir->tables[0]->pages[0]));
 
 	// load the kernel page directory
-	__asm__ volatile ("mov %0,%%cr3" :: "b"(&kdir->tables_phys[0]));
+	current_space = (uint32_t) & kdir->tables_phys[0];
+	__asm__ volatile ("mov %0,%%cr3" :: "b"(current_space));
 
 	// enable paging
 	uint32_t cr0;
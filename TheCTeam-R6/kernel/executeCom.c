@@ -221,6 +221,10 @@ int execute_com(char* buf)
 			{
 				show_free_memory();
 			}
+			else if(!strcmp(args[1], "heap"))
+			{
+				show_heap_stats();
+			}
 			else
 			{
 				print_e("Error: Use of Show. Use 'help show' for more information.");
@@ -232,6 +236,17 @@ int execute_com(char* buf)
 
 		}
 	}
+	else if (!strcmp(args[0], "bench"))
+	{
+		if (args[1] != NULL && !strcmp(args[1], "switch"))
+		{
+			bench_switch();
+		}
+		else
+		{
+			print_e("Error: Invalid bench command entered.");
+		}
+	}
 	else if (!strcmp(args[0], "clear"))
 	{
 		print("\033[2J\033[H");
@@ -94,12 +94,13 @@ void kmain(void)
 	size_t size = 50000;
 	initialize_heap(size);
 	sys_set_heap_functions(allocate_memory, free_memory);
+	set_deferred_coalescing(1);
 	// R4: create commhand and idle processes
 
 	// 9) YOUR command handler -- *create and #include an appropriate .h file*
 	// Pass execution to your command handler so the user can interact with
 	// the system.
-	serial_open(COM1, 19200);
+	serial_open(COM1, 19200, SERIAL_RX_RING_SIZE);
 	klogv(COM1, "Transferring control to commhand...");
 	char* intro1 = " ██████╗    ████████╗███████╗ █████╗ ███╗   ███╗     ██████╗ ███████╗\n██╔════╝    ╚══██╔══╝██╔════╝██╔══██╗████╗ ████║    ██╔═══██╗██╔════╝\n██║            ██║   █████╗  ███████║██╔████╔██║    ██║   ██║███████╗\n██║            ██║   ██╔══╝  ██╔══██║██║╚██╔╝██║    ██║   ██║╚════██║\n╚██████╗       ██║   ███████╗██║  ██║██║ ╚═╝ ██║    ╚██████╔╝███████║\n ╚═════╝       ╚═╝   ╚══════╝╚═╝  ╚═╝╚═╝     ╚═╝     ╚═════╝ ╚══════╝\n";
 	///*char* intro2 = "\n██╔════╝    ╚══██╔══╝██╔════╝██╔══██╗████╗ ████║    ██╔═══██╗██╔════╝";
@@ -118,14 +119,17 @@ void kmain(void)
 	sys_req(WRITE, COM1, help_introduction, strlen(help_introduction));
 	
 	
-	pcb* comhandler = pcb_setup("comhand", SYSTEM_PROCESS, 0);
+	// the command handler runs the deepest call chains, so give it more room
+	pcb* comhandler = pcb_setup("comhand", SYSTEM_PROCESS, 0, 4 * PCB_DEFAULT_STACK_SIZE);
 	initialize_context(comhandler, comhand, 0);
 
-	pcb* sysidle = pcb_setup("sysidle", SYSTEM_PROCESS, 9);
+	pcb* sysidle = pcb_setup("sysidle", SYSTEM_PROCESS, 9, PCB_DEFAULT_STACK_SIZE);
 	initialize_context(sysidle, sys_idle_process, 0);
 	processes_initialized = 1;
 	
 	__asm__ volatile ("int $0x60" :: "a"(IDLE));
+	// the last process to exit was freed while still on its stack
+	pcb_reap();
 
 	// 10) System Shutdown -- *headers to be determined by your design*
 	// After your command handler returns, take care of any clean up that
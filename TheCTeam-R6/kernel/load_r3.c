@@ -20,11 +20,11 @@
 void load_processes(int suspended, int priority)
 {
     //Load processes and initialize them
-    pcb* process1 = pcb_setup("process1", USER_PROCESS, priority);
-    pcb* process2 = pcb_setup("process2", USER_PROCESS, priority);
-    pcb* process3 = pcb_setup("process3", USER_PROCESS, priority);
-    pcb* process4 = pcb_setup("process4", USER_PROCESS, priority);
-    pcb* process5 = pcb_setup("process5", USER_PROCESS, priority);
+    pcb* process1 = pcb_setup("process1", USER_PROCESS, priority, PCB_DEFAULT_STACK_SIZE);
+    pcb* process2 = pcb_setup("process2", USER_PROCESS, priority, PCB_DEFAULT_STACK_SIZE);
+    pcb* process3 = pcb_setup("process3", USER_PROCESS, priority, PCB_DEFAULT_STACK_SIZE);
+    pcb* process4 = pcb_setup("process4", USER_PROCESS, priority, PCB_DEFAULT_STACK_SIZE);
+    pcb* process5 = pcb_setup("process5", USER_PROCESS, priority, PCB_DEFAULT_STACK_SIZE);
 
     //Initialize context
     initialize_context(process1, proc1, suspended);
@@ -38,7 +38,7 @@ void initialize_context(pcb* process, void (*function_ptr)(void), int suspended)
 {
     if (process != NULL)
     {
-        process->stack_pointer = &process->stack[1024 - sizeof(context)];
+        process->stack_pointer = &process->stack[process->stack_size - sizeof(context)];
         struct context* ctx = (struct context*)process->stack_pointer;
 
         // Initialize context values
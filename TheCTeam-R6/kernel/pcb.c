@@ -10,6 +10,9 @@
 #include <comHandler.h>
 #include <mpx/io.h>
 #include <sys_call.h>
+#include <mem_lib.h>
+#include <mpx/vm.h>
+#include <io_scheduler.h>
 
 #define MIN_NAME_LENGTH 1
 #define MAX_NAME_LENGTH 10
@@ -21,6 +24,9 @@ pcb* blocked_head = NULL;
 pcb* ready_suspended_head = NULL;
 pcb* blocked_suspended_head = NULL;
 
+// Stack of a process that was freed while still running on it (EXIT); released by pcb_reap()
+static unsigned char* retired_stack = NULL;
+
 // Returns pcb** to the correct head node. Must be dereferenced once to get an actual pointer to the usable pcb at that head.
 pcb** get_queue(pcb* pcb) {
 
@@ -48,8 +54,12 @@ pcb** get_queue(pcb* pcb) {
 pcb* pcb_allocate(void) {
     //Might have to set this to a variable check if it is NULL then return it if we want an error message, otherwise check in a higher level function
 
-    return sys_alloc_mem(sizeof(pcb));    // As stated in the memory.h file this function returns NULL on error, 
-}                                         // otherwise returns the allocated memory address
+    pcb* pcb = sys_alloc_mem(sizeof(struct pcb));    // As stated in the memory.h file this function returns NULL on error, 
+                                                     // otherwise returns the allocated memory address
+    // The PCB is allocated while its creator runs, and must not go away when the creator exits
+    disown_memory(pcb);
+    return pcb;
+}
 
 
 int pcb_free(pcb* pcb) {
@@ -58,11 +68,30 @@ int pcb_free(pcb* pcb) {
         return 1; // Avoid freeing a NULL pointer
     }
 
+    // Drop its queued I/O and stop any still in progress, before the buffers go away
+    io_release_process(pcb);
+
+    // Reclaim everything the process allocated and never freed
+    free_process_memory(pcb);
+
     // Free the allocated memory for the PCB's context
     if (pcb->context != NULL) {
         sys_free_mem(pcb->context);
     }
 
+    // Release the page directory, leaving it first if it is the one in use
+    vm_destroy_space(pcb->page_dir);
+
+    // Release the stack and the frames behind it. The running process is still on its
+    // stack until the dispatcher switches away, so that one is released by pcb_reap().
+    pcb_reap();
+    if (pcb == current_process) {
+        retired_stack = pcb->stack;
+    }
+    else {
+        vm_free_stack(pcb->stack);
+    }
+
     // Free the allocated memory for the PCB's name
     if (pcb->name != NULL) {
         sys_free_mem((void*)pcb->name);
@@ -72,13 +101,25 @@ int pcb_free(pcb* pcb) {
     return sys_free_mem(pcb);
 }
 
-pcb* pcb_setup(const char* name, int class, int priority) {
+void pcb_reap(void) {
+    vm_free_stack(retired_stack);
+    retired_stack = NULL;
+}
+
+pcb* pcb_setup(const char* name, int class, int priority, size_t stack_size) {
     if(pcb_find(name) != NULL)
     {
         print_e("Error: A PCB with this name already exists");
         return NULL;
     }
 
+    // The initial context is placed at the top of the stack, so the stack must at least hold it
+    if (stack_size < sizeof(struct context))
+    {
+        print_e("Error: Stack too small");
+        return NULL;
+    }
+
     pcb* pcb = pcb_allocate();
 
     if(pcb == NULL)
@@ -86,14 +127,22 @@ pcb* pcb_setup(const char* name, int class, int priority) {
         print_e("Error: Failed to allocate memory");
         return NULL;
     }
+    // Everything pcb_free() looks at is set before anything can fail, the memory may be recycled
+    pcb->stack = NULL;
+    pcb->name = NULL;
+    pcb->context = NULL;
+    pcb->page_dir = 0;
+    pcb->owned_blocks = NULL;
 
     
     pcb->context = sys_alloc_mem(sizeof(struct context));
     if (pcb->context == NULL)
     {
         print_e("Error: Failed to allocate memory for context");
+        pcb_free(pcb);
         return NULL;
     }
+    disown_memory(pcb->context);
     
 
 
@@ -103,8 +152,20 @@ pcb* pcb_setup(const char* name, int class, int priority) {
         pcb_free(pcb);
         return NULL;
     }
+    disown_memory((void*)pcb->name);
     pcb_find(name);
 
+    pcb->stack = vm_alloc_stack(stack_size);
+    if (pcb->stack == NULL) {
+        print_e("Error: Failed to allocate stack");
+        pcb_free(pcb);
+        return NULL;
+    }
+    pcb->stack_size = stack_size;
+
+    // Private page directory sharing the kernel tables; 0 falls back to the kernel directory
+    pcb->page_dir = vm_create_space();
+
 
     strncpy((char*)pcb->name, name, strlen(name));
 
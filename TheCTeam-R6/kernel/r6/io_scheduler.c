@@ -3,27 +3,42 @@
 #include <io_scheduler.h>
 
 
+// Outstanding async requests, a request's handle is its index here plus one
+static iocb* async_requests[IO_MAX_ASYNC] = { 0 };
 
-// Function to enqueue an iocb to the dcb queue
-void enqueue_iocb(dcb* dcb, iocb* iocb) {
-    if (dcb->iocb_queue_tail == NULL) {
-        dcb->iocb_queue_head = iocb;
+// Processes blocked in SELECT and the sets they are watching
+static struct {
+    pcb* process;
+    struct select_entry* set;
+    int count;
+} selectors[IO_MAX_SELECT] = { 0 };
+
+
+// Function to pick the channel that serves an operation
+dcb_channel* dcb_channel_for(dcb* dcb, int operation) {
+    return (operation == READ) ? &dcb->rx : &dcb->tx;
+}
+
+// Function to enqueue an iocb to a channel queue
+void enqueue_iocb(dcb_channel* channel, iocb* iocb) {
+    if (channel->iocb_queue_tail == NULL) {
+        channel->iocb_queue_head = iocb;
     }
     else {
-        dcb->iocb_queue_tail->next = iocb;
+        channel->iocb_queue_tail->next = iocb;
     }
-    dcb->iocb_queue_tail = iocb;
+    channel->iocb_queue_tail = iocb;
 }
 
-// Function to dequeue an iocb from the dcb queue
-iocb* dequeue_iocb(dcb* dcb) {
-    if (dcb->iocb_queue_head == NULL) {
+// Function to dequeue an iocb from a channel queue
+iocb* dequeue_iocb(dcb_channel* channel) {
+    if (channel->iocb_queue_head == NULL) {
         return NULL;
     }
-    iocb* iocb = dcb->iocb_queue_head;
-    dcb->iocb_queue_head = dcb->iocb_queue_head->next;
-    if (dcb->iocb_queue_head == NULL) {
-        dcb->iocb_queue_tail = NULL;
+    iocb* iocb = channel->iocb_queue_head;
+    channel->iocb_queue_head = channel->iocb_queue_head->next;
+    if (channel->iocb_queue_head == NULL) {
+        channel->iocb_queue_tail = NULL;
     }
     return iocb;
 }
@@ -49,32 +64,33 @@ int io_scheduler(int operation, device dev, char* buffer, size_t size, pcb* pcb,
 
     dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
 
-    if (!dcb->open) {
+    if (dcb == NULL || !dcb->open) {
         return ERR_PORT_NOT_OPEN;
     }
 
-    // Check the status of the requested device
-    if (dcb->status == DCB_IDLE && !waiting) {
-        // Device is available, begin processing the request immediately
-        dcb->status = (operation == READ) ? DCB_READING : DCB_WRITING;
-        dcb->input_buffer = buffer;
-        dcb->output_buffer = buffer;
-        dcb->input_size = size;
-        dcb->output_size = size;
-        dcb->event_flag = EVENT_FLAG_CLEAR;
+    dcb_channel* channel = dcb_channel_for(dcb, operation);
+
+    // Check the status of the requested direction; the other one does not matter
+    if (channel->status == DCB_IDLE && !waiting) {
+        // Channel is available, begin processing the request immediately
+        channel->status = (operation == READ) ? DCB_READING : DCB_WRITING;
+        channel->buffer = buffer;
+        channel->size = size;
+        channel->event_flag = EVENT_FLAG_CLEAR;
+        channel->owner = pcb;
 
         if (operation == READ) {
-            serial_input_interrupt(dcb);
+            serial_tty(dcb);
         }
         else {
             serial_output_interrupt(dcb);
         }
     }
     else {
-        // Device is busy, enqueue the request in the iocb queue
-        iocb* iocb = sys_alloc_mem(sizeof(struct iocb));
+        // Channel is busy, enqueue the request in its iocb queue
+        iocb* iocb = iocb_alloc(dcb, waiting);
         if (iocb == NULL) {
-            return ERR_MEMORY_ALLOCATION;
+            return ERR_IO_QUEUE_FULL;
         }
 
         iocb->operation = operation;
@@ -83,33 +99,339 @@ int io_scheduler(int operation, device dev, char* buffer, size_t size, pcb* pcb,
         iocb->next = NULL;
         iocb->process = pcb;
         iocb->waiting = waiting;
+        iocb->handle = 0;
 
-        enqueue_iocb(dcb, iocb);
+        enqueue_iocb(channel, iocb);
     }
 
     return SUCCESS;
 }
 
-// Function to process the next iocb in the queue
-void process_next_iocb(dcb* dcb) {
-    iocb* next_iocb = dequeue_iocb(dcb);
+// Function to give back the handle and memory of an async request
+static void io_release(iocb* iocb) {
+    async_requests[iocb->handle - 1] = NULL;
+    iocb_free(iocb);
+}
+
+// Function to record the result of an async request, waking its owner if it is blocked in WAIT
+static void io_complete(iocb* iocb, int result) {
+    iocb->done = 1;
+    iocb->result = result;
+
+    if (iocb->waited) {
+        ((context*)iocb->process->stack_pointer)->eax = result;
+        pcb_remove(iocb->process);
+        iocb->process->exec_state = READY;
+        pcb_insert(iocb->process);
+        io_release(iocb);
+    }
+}
+
+// Function to look up an outstanding async request of a process
+static iocb* io_lookup(int handle, pcb* pcb) {
+    if (pcb == NULL || handle < 1 || handle > IO_MAX_ASYNC) {
+        return NULL;
+    }
+    iocb* iocb = async_requests[handle - 1];
+    if (iocb == NULL || iocb->process != pcb) {
+        return NULL;
+    }
+    return iocb;
+}
+
+// Function to start or queue an async request
+int io_submit(int operation, device dev, char* buffer, size_t size, pcb* pcb) {
+    if (operation != READ && operation != WRITE) {
+        return ERR_INVALID_OPERATION;
+    }
+
+    if (!isValidDevice(dev)) {
+        return ERR_INVALID_DEVICE;
+    }
+
+    if (buffer == NULL) {
+        return ERR_INVALID_BUFFER_ADDRESS;
+    }
+
+    if (size == 0) {
+        return ERR_INVALID_COUNT;
+    }
+
+    dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
+    if (dcb == NULL || !dcb->open) {
+        return ERR_PORT_NOT_OPEN;
+    }
+
+    int slot = 0;
+    while (slot < IO_MAX_ASYNC && async_requests[slot] != NULL) {
+        slot++;
+    }
+    if (slot == IO_MAX_ASYNC) {
+        return ERR_TOO_MANY_REQUESTS;
+    }
+
+    iocb* iocb = iocb_alloc(dcb, 0);
+    if (iocb == NULL) {
+        return ERR_IO_QUEUE_FULL;
+    }
+
+    iocb->operation = operation;
+    iocb->buffer = buffer;
+    iocb->length = size;
+    iocb->next = NULL;
+    iocb->process = pcb;
+    iocb->waiting = 0;
+    iocb->handle = slot + 1;
+    iocb->done = 0;
+    iocb->result = 0;
+    iocb->waited = 0;
+    async_requests[slot] = iocb;
+
+    dcb_channel* channel = dcb_channel_for(dcb, operation);
+    if (channel->status == DCB_IDLE) {
+        // Start it now; its completion is picked up by process_next_iocb() like any other
+        channel->active = iocb;
+        int ret = (operation == READ) ? serial_read(dev, buffer, size) : serial_write(dev, buffer, size);
+        if (ret < 0) {
+            channel->active = NULL;
+            io_release(iocb);
+            return ret;
+        }
+        channel->owner = pcb;
+    }
+    else {
+        enqueue_iocb(channel, iocb);
+    }
+
+    return iocb->handle;
+}
+
+// Function to check an async request without blocking
+int io_poll(int handle, pcb* pcb) {
+    iocb* iocb = io_lookup(handle, pcb);
+    if (iocb == NULL) {
+        return ERR_INVALID_HANDLE;
+    }
+    return iocb->done;
+}
+
+// Function to collect the result of an async request, or mark it so its completion wakes the owner
+int io_wait(int handle, pcb* pcb, int* result) {
+    iocb* iocb = io_lookup(handle, pcb);
+    if (iocb == NULL) {
+        return ERR_INVALID_HANDLE;
+    }
+
+    if (iocb->done) {
+        *result = iocb->result;
+        io_release(iocb);
+        return 1;
+    }
+
+    iocb->waited = 1;
+    return 0;
+}
+
+// Function to fill in the ready events of a select set, returns the first ready index or -1
+static int select_scan(struct select_entry* set, int count) {
+    int fired = -1;
+    for (int i = 0; i < count; i++) {
+        dcb* dcb = dcb_array[get_dcb_index(set[i].dev) - 1];
+        set[i].revents = 0;
+
+        // A READ in progress takes the input as it arrives, so the device is only readable when idle
+        if ((set[i].events & SELECT_READ) && dcb->rx.status == DCB_IDLE && dcb->ring_head != dcb->ring_tail) {
+            set[i].revents |= SELECT_READ;
+        }
+        if ((set[i].events & SELECT_WRITE) && dcb->tx.status == DCB_IDLE
+            && (dcb->tx_head + 1) % SERIAL_TX_RING_SIZE != dcb->tx_tail) {
+            set[i].revents |= SELECT_WRITE;
+        }
+
+        if (set[i].revents && fired < 0) {
+            fired = i;
+        }
+    }
+    return fired;
+}
+
+// Function to check a select set, or record the process to be woken when one of its events is ready
+int io_select(struct select_entry* set, int count, pcb* pcb, int* fired) {
+    if (set == NULL) {
+        return ERR_INVALID_BUFFER_ADDRESS;
+    }
+
+    if (count <= 0) {
+        return ERR_INVALID_COUNT;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!isValidDevice(set[i].dev)) {
+            return ERR_INVALID_DEVICE;
+        }
+        dcb* dcb = dcb_array[get_dcb_index(set[i].dev) - 1];
+        if (dcb == NULL || !dcb->open) {
+            return ERR_PORT_NOT_OPEN;
+        }
+    }
+
+    *fired = select_scan(set, count);
+    if (*fired >= 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < IO_MAX_SELECT; i++) {
+        if (selectors[i].process == NULL) {
+            selectors[i].process = pcb;
+            selectors[i].set = set;
+            selectors[i].count = count;
+            return 0;
+        }
+    }
+    return ERR_TOO_MANY_REQUESTS;
+}
+
+// Function to wake the processes blocked in SELECT whose events are ready
+void io_select_wake(void) {
+    for (int i = 0; i < IO_MAX_SELECT; i++) {
+        pcb* process = selectors[i].process;
+        if (process == NULL) {
+            continue;
+        }
+
+        int fired = select_scan(selectors[i].set, selectors[i].count);
+        if (fired < 0) {
+            continue;
+        }
+
+        ((context*)process->stack_pointer)->eax = fired;
+        pcb_remove(process);
+        process->exec_state = READY;
+        pcb_insert(process);
+        selectors[i].process = NULL;
+    }
+}
+
+// Function to stop the operation in progress on a channel whose owner is gone, so it no longer uses the buffer
+static void io_stop(dcb* dcb, dcb_channel* channel) {
+    unsigned int flags;
+    irq_save(flags);
+    channel->status = DCB_IDLE;
+    channel->buffer = NULL;
+    channel->size = 0;
+    channel->owner = NULL;
+    // The next dispatch goes on with whatever is queued behind it
+    channel->event_flag = EVENT_FLAG_SET;
+
+    // The next READ is started without serial_read(), so the line being edited is dropped here
+    if (channel == &dcb->rx) {
+        dcb->input_count = 0;
+        dcb->edit_index = 0;
+        dcb->escape_state = 0;
+        dcb->rx_timeout = 0;
+    }
+    irq_restore(flags);
+}
+
+// Function to drop the requests of a process from one channel, stopping its operation if one is in progress
+static void io_release_channel(dcb* dcb, dcb_channel* channel, pcb* pcb) {
+    // An async request in progress, or completed and not yet picked up by process_next_iocb()
+    if (channel->active != NULL && channel->active->process == pcb) {
+        io_release(channel->active);
+        channel->active = NULL;
+    }
+
+    iocb* prev = NULL;
+    iocb* request = channel->iocb_queue_head;
+    while (request != NULL) {
+        iocb* next = request->next;
+        if (request->process != pcb) {
+            prev = request;
+            request = next;
+            continue;
+        }
+
+        if (prev == NULL) {
+            channel->iocb_queue_head = next;
+        }
+        else {
+            prev->next = next;
+        }
+        if (channel->iocb_queue_tail == request) {
+            channel->iocb_queue_tail = prev;
+        }
+
+        if (request->handle) {
+            io_release(request);
+        }
+        else {
+            iocb_free(request);
+        }
+        request = next;
+    }
+
+    if (channel->owner == pcb) {
+        io_stop(dcb, channel);
+    }
+}
+
+// Function to let go of the I/O requests of a process that is being freed
+void io_release_process(pcb* pcb) {
+    for (int i = 0; i < 4; i++) {
+        if (dcb_array[i] != NULL) {
+            io_release_channel(dcb_array[i], &dcb_array[i]->rx, pcb);
+            io_release_channel(dcb_array[i], &dcb_array[i]->tx, pcb);
+        }
+    }
+
+    // What is left are async requests that completed and were never collected
+    for (int i = 0; i < IO_MAX_ASYNC; i++) {
+        if (async_requests[i] != NULL && async_requests[i]->process == pcb) {
+            io_release(async_requests[i]);
+        }
+    }
+
+    // A process blocked in SELECT must not be woken once it is gone
+    for (int i = 0; i < IO_MAX_SELECT; i++) {
+        if (selectors[i].process == pcb) {
+            selectors[i].process = NULL;
+        }
+    }
+}
+
+// Function to process the next iocb in the queue of one channel
+void process_next_iocb(dcb* dcb, int operation) {
+    dcb_channel* channel = dcb_channel_for(dcb, operation);
+
+    // The operation that just finished may have been an async request
+    if (channel->active != NULL) {
+        io_complete(channel->active, (operation == READ) ? dcb->rx_count : (int)channel->active->length);
+        channel->active = NULL;
+    }
+
+    iocb* next_iocb = dequeue_iocb(channel);
     if (next_iocb != NULL && !next_iocb->waiting) {
-        dcb->status = (next_iocb->operation == READ) ? DCB_READING : DCB_WRITING;
-        dcb->input_buffer = next_iocb->buffer;
-        dcb->output_buffer = next_iocb->buffer;
-        dcb->input_size = next_iocb->length;
-        dcb->output_size = next_iocb->length;
-        dcb->event_flag = EVENT_FLAG_CLEAR;
-        pcb_remove(next_iocb->process);
-        next_iocb->process->exec_state = READY;
-        pcb_insert(next_iocb->process);
+        channel->status = (next_iocb->operation == READ) ? DCB_READING : DCB_WRITING;
+        channel->buffer = next_iocb->buffer;
+        channel->size = next_iocb->length;
+        channel->event_flag = EVENT_FLAG_CLEAR;
+        channel->owner = next_iocb->process;
 
-        if (next_iocb->operation == READ) {
-            iocb_free(next_iocb);
-            serial_input_interrupt(dcb);
+        if (next_iocb->handle) {
+            // An async request belongs to a process that is not blocked; it keeps the iocb until WAIT
+            channel->active = next_iocb;
         }
         else {
+            pcb_remove(next_iocb->process);
+            next_iocb->process->exec_state = READY;
+            pcb_insert(next_iocb->process);
             iocb_free(next_iocb);
+        }
+
+        if (operation == READ) {
+            serial_tty(dcb);
+        }
+        else {
             serial_output_interrupt(dcb);
         }
 
@@ -117,24 +439,65 @@ void process_next_iocb(dcb* dcb) {
     }
     else if(next_iocb != NULL && next_iocb->waiting)
     {
-        dcb->input_buffer = next_iocb->buffer;
-        dcb->output_buffer = next_iocb->buffer;
-        dcb->input_size = next_iocb->length;
-        dcb->output_size = next_iocb->length;
-        dcb->event_flag = EVENT_FLAG_CLEAR;
+        // The operation that just finished was this process's own, so a reader gets its length back
+        if (next_iocb->operation == READ) {
+            ((context*)next_iocb->process->stack_pointer)->eax = dcb->rx_count;
+        }
+        channel->buffer = next_iocb->buffer;
+        channel->size = next_iocb->length;
+        channel->event_flag = EVENT_FLAG_CLEAR;
         pcb_remove(next_iocb->process);
         next_iocb->process->exec_state = READY;
         pcb_insert(next_iocb->process);
         iocb_free(next_iocb);
+
+        // The channel is free now, so start whatever queued up behind it
+        process_next_iocb(dcb, operation);
     }
     else
     {
-        dcb->status = DCB_IDLE;
+        channel->status = DCB_IDLE;
+        channel->owner = NULL;
     }
 
 
 
 
+}
+
+int iocb_pool_init(dcb* dcb)
+{
+    dcb->iocb_pool = sys_alloc_mem(DCB_IOCB_POOL_SIZE * sizeof(struct iocb));
+    if (dcb->iocb_pool == NULL)
+    {
+        return ERR_MEMORY_ALLOCATION;
+    }
+
+    // A free IOCB is never on a queue, so the queue link doubles as the free list link
+    dcb->iocb_free = NULL;
+    for (int i = DCB_IOCB_POOL_SIZE - 1; i >= 0; i--)
+    {
+        dcb->iocb_pool[i].dcb = dcb;
+        dcb->iocb_pool[i].next = dcb->iocb_free;
+        dcb->iocb_free = &dcb->iocb_pool[i];
+    }
+    dcb->iocb_available = DCB_IOCB_POOL_SIZE;
+    return SUCCESS;
+}
+
+iocb* iocb_alloc(dcb* dcb, int waiting)
+{
+    // New requests leave the reserve alone, see DCB_IOCB_RESERVED
+    if (dcb->iocb_available <= (waiting ? 0 : DCB_IOCB_RESERVED))
+    {
+        return NULL;
+    }
+
+    iocb* iocb = dcb->iocb_free;
+    dcb->iocb_free = iocb->next;
+    dcb->iocb_available--;
+    iocb->next = NULL;
+    return iocb;
 }
 
 int iocb_free(iocb* iocb)
@@ -144,6 +507,10 @@ int iocb_free(iocb* iocb)
         return 1;
     }
 
-    return sys_free_mem(iocb);
+    dcb* dcb = iocb->dcb;
+    iocb->next = dcb->iocb_free;
+    dcb->iocb_free = iocb;
+    dcb->iocb_available++;
+    return SUCCESS;
 }
 
@@ -1,5 +1,6 @@
 
 #include <serial_interrupts.h>
+#include <io_scheduler.h>
 
 
 /*
@@ -15,6 +16,9 @@
 #define KEY_CARRIAGE_RETURN 0x0D // \r
 #define KEY_NEWLINE 0x0A // \n
 
+//Keeps the compiler from moving ring buffer accesses across an update of the ring indices
+#define COMPILER_BARRIER() __asm__ volatile("" ::: "memory")
+
 
 dcb* dcb_array[4] = { 0 };
 int processes_initialized = 0;
@@ -64,6 +68,12 @@ int isValidDevice(device dev)
     return (dev == 0x3f8 || dev == 0x2f8 || dev == 0x3e8 || dev == 0x2e8);
 }
 
+//COM1 and COM3 share IRQ4, COM2 and COM4 share IRQ3
+static int get_irq(device dev)
+{
+    return (get_dcb_index(dev) % 2) ? SERIAL_IRQ_COM1_COM3 : SERIAL_IRQ_COM2_COM4;
+}
+
 
 
 /*
@@ -97,12 +107,13 @@ enum registers
 {
     IER = 1,
     IIR = 2,
+    FCR = 2, //Write side of the IIR port
     LCR = 3,
     MCR = 4,
     LSR = 5,
     MSR = 6,
 };
-int serial_open(device dev, int speed)
+int serial_open(device dev, int speed, size_t ring_size)
 {
     if (!isValidDevice(dev))
     {
@@ -112,25 +123,74 @@ int serial_open(device dev, int speed)
     {
         return ERR_INVALID_BAUD_DIVISOR;
     }
+    if (ring_size < 2 || (ring_size & (ring_size - 1)) != 0) //Power of two, so indices can be masked
+    {
+        return ERR_INVALID_RING_SIZE;
+    }
 
-    dcb* dcb = sys_alloc_mem(sizeof(struct dcb));
-    dcb_array[get_dcb_index(dev) - 1] = dcb;
-    dcb->device_id = dev;
-    if (dcb->open == 1)
+    //The DCB is kept after a close so the port can be opened again without allocating
+    dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
+    if (dcb && dcb->open == 1)
     {
         return ERR_PORT_ALREADY_OPEN;
     }
+    if (!dcb)
+    {
+        dcb = sys_alloc_mem(sizeof(struct dcb));
+        if (!dcb)
+        {
+            return ERR_INVALID_DEVICE;
+        }
+        dcb->ring_buffer = NULL;
+        dcb->ring_size = 0;
+        dcb->iocb_pool = NULL;
+        dcb_array[get_dcb_index(dev) - 1] = dcb;
+    }
+    dcb->device_id = dev;
+
+    //Keep the ring from a previous open if it is the right size
+    if (dcb->ring_size != ring_size)
+    {
+        if (dcb->ring_buffer)
+        {
+            sys_free_mem(dcb->ring_buffer);
+        }
+        dcb->ring_buffer = sys_alloc_mem(ring_size);
+        dcb->ring_size = dcb->ring_buffer ? ring_size : 0;
+        if (!dcb->ring_buffer)
+        {
+            return ERR_INVALID_RING_SIZE;
+        }
+    }
+
+    //Requests that wait for the port come from its own IOCB pool, allocated once
+    if (!dcb->iocb_pool && iocb_pool_init(dcb) != SUCCESS)
+    {
+        return ERR_MEMORY_ALLOCATION;
+    }
 
     //Initialize DCB
     dcb->open = 1;
-    dcb->event_flag = 0;
-    dcb->status = DCB_IDLE; //0
+    dcb->rx.event_flag = dcb->tx.event_flag = 0;
+    dcb->rx.status = dcb->tx.status = DCB_IDLE; //0, receiving and transmitting are independent
     dcb->ring_head = dcb->ring_tail = 0; //Set ring head and ring tail to 0 bc buffer is empty
-    dcb->iocb_queue_head = dcb->iocb_queue_tail = NULL;
+    dcb->rx_dropped = 0;
+    dcb->mode = SERIAL_MODE_CANONICAL; //Ports start with line editing, IOCTL can switch to raw
+    dcb->rx_timeout = 0;
+    dcb->rx_count = 0;
+    dcb->tx_head = dcb->tx_tail = 0; //Transmit ring starts empty too
+    dcb->rx.iocb_queue_head = dcb->rx.iocb_queue_tail = NULL;
+    dcb->tx.iocb_queue_head = dcb->tx.iocb_queue_tail = NULL;
+    dcb->rx.active = dcb->tx.active = NULL;
+    dcb->rx.owner = dcb->tx.owner = NULL;
+    dcb->escape_state = 0; //Line editing state is per port so several ports can be read at once
+    dcb->edit_index = 0;
+    dcb->input_count = 0;
 
     unsigned short base = dev;  //Assign base to the base IO of the device
+    int irq = get_irq(dev);
 
-    idt_install(0x24, (void(*)(void*))serial_isr); //Installs ISR into the Interrupt Descriptor Table <mpx/interrupts.h>
+    idt_install(PIC_VECTOR_BASE + irq, (void(*)(void*))serial_isr); //Installs ISR on this port's IRQ vector <mpx/interrupts.h>
 
     //Figure out baud rate r6d_12 and r6d_13
     int divisor = 115200 / speed; //Calc divisor for desired baud rate
@@ -161,32 +221,25 @@ int serial_open(device dev, int speed)
     outb(base + IER, (divisor >> 8)); //Set high byte of divisor
     outb(base + LCR, 0x03); //Line Control Register 0x03 = 00000011, Restores first two ports functionality, Sets line characteristics to 8 bits, 1 stop bit, no parity
 
+    //Enable and clear both FIFOs. The UART now raises an input interrupt once rx_trigger bytes
+    //are waiting, or a receive timeout interrupt when fewer arrive and the line goes quiet
+    dcb->rx_trigger = SERIAL_RX_TRIGGER_8;
+    outb(base + FCR, FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX | dcb->rx_trigger);
+
     //Enable serial input interrupts
    //outb(base + 1, 0x01); //Enable received data available interrupt, IER 00000001
     
     int mask = inb(PIC_MASK_PORT); //Read the current interrupt mask
-    mask &= ~(1 << (3 + (get_dcb_index(dev) % 2))); //Enable IRQ (Interrupt requests) for this serial port
+    mask &= ~(1 << irq); //Enable IRQ (Interrupt requests) for this serial port
     /* Mask Values for Com1: Correct
     * Initial Mask: 184, 10111000
     * Modified Mask: 168,10101000 
     */
     /*
-    * Line above looks insane so here is an explanation:
-    * COM1 and COM3 share IRQ4, COM2 and COM4 share IRQ3.
-    * dev % 2 : Calcs whether device is even or odd
-    * 3 + dev % 2 : Determines IRQ line associated with serial port. 
-    * Ex. if dev = 1 (COM1), results is 3 + 1 = 4. if dev = 2 (COM2), result is 3 + 0 = 3.
-    * 1 << (4 + (dev % 2)) : Bitmask so only bit corresponding to calculated IRQ is set to 1.
-    * Ex. For IRQ4, 1 << 4 = 0x00010000. For IRQ3, 1 << 5 = 0b00100000.
-    * ~ : Inverts the bitmask, so bit for target IRQ is 0 and all other bits are 1.
-    * &= Basically undoes the ~ except for the bit we care about here, a.k.a it ensures all other bits remain unchanged
-    * Full Example for COM1 (dev = 1)
-    * dev % 2 = 1;
-    * 4 + 1 = 5;
-    * 1 << 5 = 0b00100000;
-    * ~(0b00010000) = 0b11101111;
-    * mask &= 0b11101111; Enables IRQ4 for COM1. 4th bit (starting from 0 on the right) is now 0. 
-    * NO idea if this will actually work!
+    * ~(1 << irq) : Bitmask with only the bit for this port's IRQ cleared
+    * &= : Clears that bit and leaves the other bits unchanged
+    * Ex. COM1 is on IRQ4, so 1 << 4 = 0b00010000, ~ = 0b11101111, and bit 4 of the mask is now 0.
+    * COM3 uses the same line, so opening it after COM1 leaves the mask as it was.
     */
     
     outb(PIC_MASK_PORT, mask); //Write updated mask to PIC
@@ -202,6 +255,75 @@ int serial_open(device dev, int speed)
 
 
 
+int serial_set_rx_trigger(device dev, unsigned char trigger)
+{
+    if (!isValidDevice(dev))
+    {
+        return ERR_INVALID_DEVICE;
+    }
+
+    if (trigger & ~SERIAL_RX_TRIGGER_14)
+    {
+        return ERR_INVALID_EVENT;
+    }
+
+    dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
+    if (!dcb || !dcb->open)
+    {
+        return ERR_PORT_NOT_OPEN;
+    }
+
+    //FCR is write only, so the enable bit has to be written with the new level every time.
+    //Raw mode keeps its own level, this one is applied when the port goes back to canonical
+    dcb->rx_trigger = trigger;
+    if (dcb->mode == SERIAL_MODE_CANONICAL)
+    {
+        outb(dev + FCR, FCR_ENABLE | trigger);
+    }
+    return SUCCESS;
+}
+
+
+
+int serial_ioctl(device dev, int command, int arg)
+{
+    if (!isValidDevice(dev))
+    {
+        return ERR_INVALID_DEVICE;
+    }
+
+    dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
+    if (!dcb || !dcb->open)
+    {
+        return ERR_PORT_NOT_OPEN;
+    }
+
+    switch (command)
+    {
+    case SERIAL_SET_MODE:
+        if (arg != SERIAL_MODE_CANONICAL && arg != SERIAL_MODE_RAW)
+        {
+            return ERR_INVALID_COMMAND;
+        }
+        if (dcb->rx.status != DCB_IDLE)
+        {
+            return ERR_DEVICE_BUSY;
+        }
+        dcb->mode = arg;
+        dcb->rx_timeout = 0;
+        dcb->escape_state = 0;
+        //Raw mode runs the FIFO at 14 bytes so the ISR can leave one behind, see serial_input_interrupt()
+        outb(dev + FCR, FCR_ENABLE | (arg == SERIAL_MODE_RAW ? SERIAL_RX_TRIGGER_14 : dcb->rx_trigger));
+        return SUCCESS;
+    case SERIAL_SET_RX_TRIGGER:
+        return serial_set_rx_trigger(dev, (unsigned char)arg);
+    default:
+        return ERR_INVALID_COMMAND;
+    }
+}
+
+
+
 int serial_close(device dev)
 {
     if (!isValidDevice(dev))
@@ -209,8 +331,8 @@ int serial_close(device dev)
         return ERR_INVALID_DEVICE;
     }
 
-    dcb* dcb = dcb_array[dev - 1];
-    if (!dcb->open)
+    dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
+    if (!dcb || !dcb->open)
     {
         return ERR_PORT_NOT_OPEN;
     }
@@ -219,13 +341,26 @@ int serial_close(device dev)
 
     dcb->open = 0; //Mark port as closed
 
-    int mask = inb(PIC_MASK_PORT); //Read current interrupt mask
-    mask |= (1 << (4 + (dev % 2))); //Disable IRQ for this serial port
-    /*
-    * Similar to the long explanation from before, |= is bitwise OR operator, so this 
-    * basically just sets the bit at the right position to 1 and doesn't change the other values. r6_17 
-    */
-    outb(PIC_MASK_PORT, mask); //Write updated mask back to PIC
+    //The IRQ line is shared with one other port, only mask it if that port is closed too
+    int irq_in_use = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (dcb_array[i] && dcb_array[i]->open && get_irq(dcb_array[i]->device_id) == get_irq(dev))
+        {
+            irq_in_use = 1;
+        }
+    }
+
+    if (!irq_in_use)
+    {
+        int mask = inb(PIC_MASK_PORT); //Read current interrupt mask
+        mask |= (1 << get_irq(dev)); //Disable IRQ for this serial port
+        /*
+        * Similar to the long explanation from before, |= is bitwise OR operator, so this 
+        * basically just sets the bit at the right position to 1 and doesn't change the other values. r6_17 
+        */
+        outb(PIC_MASK_PORT, mask); //Write updated mask back to PIC
+    }
 
     outb(base + 4, 0x00); //Disable all modem control interrupts
     outb(base + 1, 0x00); //Disable all serial interrupts
@@ -253,94 +388,32 @@ int serial_read(device dev, char* buf, size_t len)
     }
 
     dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
-    if (!dcb->open) 
+    if (!dcb || !dcb->open)
     {
         return ERR_PORT_NOT_OPEN;
     }
 
-    if (dcb->status != DCB_IDLE)
+    if (dcb->rx.status != DCB_IDLE)
     {
         return ERR_DEVICE_BUSY;
     }
 
-    dcb->input_buffer = buf;
-    dcb->input_size = len;
-    dcb->status = DCB_READING; //DCB_READING (1) status
-    dcb->event_flag = 0; //Clear caller's event flag
+    dcb->rx.buffer = buf;
+    dcb->rx.size = len;
+    dcb->rx.status = DCB_READING; //DCB_READING (1) status
+    dcb->rx.event_flag = 0; //Clear caller's event flag
 
-    size_t count = 0;
+    dcb->input_count = 0;
+    dcb->edit_index = 0;
 
-    cli(); //Disable interrupts to prevent concurrent access to ring buffer
-
-    //Copy characters from the ring buffer to the requestor's buffer
-    /*
-    * While loop explanation:
-    * While logic:
-    * count < len : Ensures number of bytes read (count) does not exceed requested length (len)
-    * && dcb->ring_head != dcb->ring_tail : Ensures there are still characters in the ring buffer to read
-    * end While logic
-    * 
-    * buf[count] = dcb->ring_buffer[dcb->ring_tail] : Copies a character from the ring buffer to the user's buffer
-    * : ring_tail points to the next character in the ring buffer to be read
-    * : The character at this position is copied into buf[count], where count tracks how many characters have been read thus far
-    * 
-    * dcb->ring_tail = (dcb->ring_tail + 1) % sizeof(dcb->ring_buffer) : Advance the ring_tail pointer
-    * : After reading a character, ring_tail is incremented by 1 to point to the next character
-    * : (dcb->ring_tail + 1) % sizeof(dcb->ring_buffer) : Calculation ensures ring_tail wraps around when it reaches end of buffer
-    * : Modulus % is used to keep ring_tail within the bounds of the ring buffer's size
-    * : This makes the ring_buffer a circular buffer
-    * 
-    * If logic: 
-    * buf[count - 1] == '\n' : Checks if last character read into buffer is a newline, break if so
-    */
-    while (count < len && dcb->ring_head != dcb->ring_tail)
-    {
-        if (dcb->ring_buffer[dcb->ring_tail] == '\r' || dcb->ring_buffer[dcb->ring_tail] == '\n')
-        {
-            break;
-        }
-        buf[count] = dcb->ring_buffer[dcb->ring_tail];
-        dcb->ring_tail = (dcb->ring_tail + 1) % sizeof(dcb->ring_buffer);
-        count++;
-        /*if (buf[count - 1] == '\n' || buf[count - 1] == '\r')
-        {
-            break;
-        }*/
-    }
-   
-    sti(); //Re-enable interrupts
-
-    /*
-    * If the ring buffer does not contain enough characters to fulfill the request, then more reading
-    * must be done via the ISR as new characters arrive.
-    * 
-    * If logic:
-    * count < len : If count < len, this means the number of characters already read from the ring buffer
-    * is less than the requested number len
-    * Basically, the user buffer is not full yet, and we need to read more characters into it
-    * 
-    * dcb->input_buffer += count : Moves the pointer forward by count characters, so the next characters
-    * will be placed correctly
-    * 
-    * dcb->input_size -= count : input_size keeps track of how many characters are left to be read
-    * Since count characters have been read, we need to subtract count from the input_size.
-    * 
-    * return SUCCESS : Since there are more characters to be read, we return SUCCESS to allow the ISR
-    * to handle the continuation of reading. When new data arrives, it will write directly to the remaining
-    * part of the user buffer (dcb->input_buffer) until either the buffer is full or the requested number of 
-    * characters (len) has been received
-    */
-    if (count < len && buf[count - 1] != '\n' && buf[count - 1] != '\r') //If more characters are needed, return
+    //Edit whatever was typed ahead into the line. If that does not finish it, the rest is
+    //edited in by serial_tty() at dispatch as more input arrives
+    int count = serial_tty(dcb);
+    if (count < 0)
     {
-        dcb->input_buffer += count;
-        dcb->input_size -= count;
-        return SUCCESS; //Reading will continue via ISR
+        return SUCCESS; //Reading will continue at dispatch
     }
 
-    //If block is complete, reset DCB status to DCB_IDLE and set event flag to indicate completion
-    dcb->status = DCB_IDLE; //0
-    dcb->event_flag = EVENT_FLAG_SET; //1
-
     return count;
 
 }
@@ -364,23 +437,24 @@ int serial_write(device dev, char* buf, size_t len)
     }
 
     dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
-    if (!dcb->open)
+    if (!dcb || !dcb->open)
     {
         return ERR_PORT_NOT_OPEN;
     }
 
-    if (dcb->status != DCB_IDLE)
+    if (dcb->tx.status != DCB_IDLE)
     {
         return ERR_DEVICE_BUSY;
     }
 
     
-    cli();
-    dcb->output_buffer = buf; //Set the dcb's output buffer to point to the passed in buffer
-    dcb->output_size = len; //Set output_size to equal requested write length
-    dcb->status = DCB_WRITING; //2
-    dcb->event_flag = EVENT_FLAG_CLEAR; //0
-    sti();
+    unsigned int flags;
+    irq_save(flags);
+    dcb->tx.buffer = buf; //Set the dcb's output buffer to point to the passed in buffer
+    dcb->tx.size = len; //Set tx.size to equal requested write length
+    dcb->tx.status = DCB_WRITING; //2
+    dcb->tx.event_flag = EVENT_FLAG_CLEAR; //0
+    irq_restore(flags);
 
     unsigned short base = dev;
     if (!processes_initialized)
@@ -390,350 +464,385 @@ int serial_write(device dev, char* buf, size_t len)
             while (!(inb(base + 5) & 0x20));
             outb(base, *buf++);
         }
-        dcb->status = DCB_IDLE;  // Set status to DCB_IDLE
-        dcb->event_flag = EVENT_FLAG_SET;  // Indicate writing completion
+        dcb->tx.status = DCB_IDLE;  // Set status to DCB_IDLE
+        dcb->tx.event_flag = EVENT_FLAG_SET;  // Indicate writing completion
         return SUCCESS;
     }
 
-    if (len > 0)
+    //Copy as much as fits into the transmit ring and start the transmitter. If it all fits the
+    //write is complete now; otherwise the rest is copied in by the ISR as the ring drains
+    serial_output_interrupt(dcb);
+
+    return SUCCESS; //Writing will continue via ISR
+}
+
+
+
+
+
+
+
+/*
+* Top half of input: runs inside the serial ISR, so it does as little as possible.
+* While logic:
+* : inb(base + LSR) & 0x01 : Data ready, the receive FIFO still has bytes in it
+* : Each byte goes into the ring buffer as it is; nothing is echoed or interpreted here
+* : If the ring is full the byte is dropped and counted in rx_dropped
+* Reading the bytes is also what acknowledges the input and receive timeout interrupts.
+* Echo and line editing happen later, in serial_tty().
+*
+* Raw reads end when the line goes quiet, which the UART reports as a receive timeout. That interrupt
+* only comes if bytes are left in the FIFO, so in raw mode a data interrupt reads one byte less than
+* the trigger level and the rest is picked up by the timeout.
+*/
+void serial_input_interrupt(struct dcb* dcb, int timeout)
+{
+    unsigned short base = dcb->device_id;
+    int left = (dcb->mode == SERIAL_MODE_RAW && !timeout) ? SERIAL_RAW_TRIGGER_BYTES - 1 : -1;
+    while (left != 0 && (inb(base + LSR) & 0x01)) // While data is available in the Receiver Buffer
     {
-        outb(base, dcb->output_buffer[0]); //Write the first character to the serial port
-        dcb->output_buffer++; //Move the pointer to the next character
-        dcb->output_size--; //Decrement the size of the buffer
-        if (dcb->output_size == 0) {
-            dcb->status = DCB_IDLE;  // Set status to DCB_IDLE
-            dcb->event_flag = EVENT_FLAG_SET;  // Indicate writing completion
-            return SUCCESS;
+        if (left > 0)
+        {
+            left--;
+        }
+        char received_char = inb(base);
+        if (dcb->ring_head - dcb->ring_tail == dcb->ring_size) // Ring is full
+        {
+            dcb->rx_dropped++;
+            continue;
         }
+        dcb->ring_buffer[dcb->ring_head & (dcb->ring_size - 1)] = received_char;
+        COMPILER_BARRIER(); //The byte is stored before the reader can see it
+        dcb->ring_head++;
     }
+    dcb->rx_timeout = timeout;
+}
 
-    //Enable output interrupts to continue writing the rest of the data
-    unsigned char ier = inb(base + 1); //Read the current interrupt enable register (ier)
-    /*
-    * Write back to the IER
-    * ier | 0x02 : Bitwise OR to set specific bit in IER while keeping the rest of the bits unchanged
-    * 0x02 is hexadecimal value representing a bitmask where only the second bit (bit 1) is set to 1. Binary: 00000010
-    * Basically just sets bit 1 of the IER to while not changing the others
-    */
-    outb(base + 1, ier | 0x02); //Enable transmitter holding register empty interrupt
 
-    return SUCCESS; //Writing will continue via ISR
-}
+/*
+* Takes up to len bytes out of the receive ring. The indices run freely and are masked with the
+* power of two ring size, so the bytes are at most two contiguous pieces: from the tail to the end
+* of the buffer, then from the start. The ISR only ever moves ring_head and this only moves ring_tail,
+* so interrupts can stay enabled; input that arrives meanwhile is left for the next call.
+*/
+static size_t ring_take(struct dcb* dcb, char* dst, size_t len)
+{
+    size_t head = dcb->ring_head;
+    COMPILER_BARRIER(); //Bytes up to head are stored, read them after head
+    size_t available = head - dcb->ring_tail;
+    if (len > available)
+    {
+        len = available;
+    }
 
+    size_t start = dcb->ring_tail & (dcb->ring_size - 1);
+    size_t first = dcb->ring_size - start;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(dst, dcb->ring_buffer + start, first);
+    memcpy(dst + first, dcb->ring_buffer, len - first);
 
+    COMPILER_BARRIER(); //Done with the bytes before the ISR may reuse their space
+    dcb->ring_tail += len;
+    return len;
+}
 
+//Queues one byte of echo behind any output already in the transmit ring, dropped if the ring is full.
+//The output ISR also stores into the ring (tx_fill), so the update is done with interrupts off
+static void tty_echo(struct dcb* dcb, char c)
+{
+    unsigned int flags;
+    irq_save(flags);
+    size_t next_head = (dcb->tx_head + 1) % SERIAL_TX_RING_SIZE;
+    if (next_head != dcb->tx_tail)
+    {
+        dcb->tx_ring[dcb->tx_head] = c;
+        dcb->tx_head = next_head;
+    }
+    irq_restore(flags);
+}
 
+/*
+* Raw mode: bytes are copied to the caller as they are, without echo. The read completes once the
+* buffer is full, or once the ISR has seen a receive timeout and at least one byte has arrived.
+*/
+static int tty_raw(struct dcb* dcb)
+{
+    if (dcb->rx.status != DCB_READING)
+    {
+        return -1;
+    }
 
+    dcb->input_count += ring_take(dcb, dcb->rx.buffer + dcb->input_count, dcb->rx.size - dcb->input_count);
 
+    if ((size_t)dcb->input_count < dcb->rx.size && !(dcb->rx_timeout && dcb->input_count > 0))
+    {
+        return -1;
+    }
+
+    int completed = dcb->input_count;
+    dcb->rx_count = completed;
+    dcb->rx_timeout = 0;
+    dcb->input_count = 0;
+    dcb->rx.status = DCB_IDLE;  // Set status to DCB_IDLE
+    dcb->rx.event_flag = EVENT_FLAG_SET;  // Indicate reading completion
+    return completed;
+}
 
-void serial_input_interrupt(struct dcb* dcb)
+/*
+* Bottom half of input, the line discipline. Takes the bytes the ISR left in the ring buffer and edits
+* them into the line being read:
+* : ESC [ A/B/C/D : Arrow keys, left and right move the cursor within the line
+* : Backspace/Delete : Removes the character before the cursor and redraws the rest of the line
+* : \r or \n : Ends the line, the read is complete
+* : Anything else : Inserted at the cursor, shifting the rest of the line right
+* One byte of the caller's buffer is kept for the terminating '\0'.
+* Echo goes through the transmit ring, so the terminal is redrawn by the output ISR instead of here.
+* Bytes that arrive while no read is in progress stay in the ring and are edited into the next read.
+*/
+int serial_tty(struct dcb* dcb)
 {
-    /*
-    * Determine base IO of device
-    * dcb - dcb_array : This should work because pointer artihmetic betweeen two pointers that point to
-    * elements of the same array results in the offset between them
-    * Ex. if dcb points to the dcb for COM3, dcb - dcb_array would be 2.
-    * + 1 : DCB array is indexed from 0, so we need to add one for the right device
-    *
-    * While logic:
-    * : inb(base+5) : Reads the LSR
-    * : & 0x01 : Bitwise to make sure bit 0 is 1, indicating there is data available to read
-    *
-    * : char received_char = inb(base) : Reads a character from the base address
-    * : size_t next_head = (dcb->ring_head + 1) & sizeof(dcb->ring_buffer) : Like earlier, calculates
-    * position of ring_head and wraps around if necessary
-    *
-    * If logic:
-    * : next_head != dcb->ring_tail : Checks if the ring buffer is not full
-    * : dcb->ring_buffer[dcb->ring_head] = received_char : Stores received character in ring buffer
-    * : dcb->ring_head = next_head : Moves head pointer to next position
-    * end If;
-    *
-    * If logic:
-    * : dcb->status = DCB_READING && dcb->input_size > 0 : Checks if device is reading, and if there is space
-    * left in the input buffer
-    *
-    * : *dcb->input_buffer++ = received_char : Copies received character directly to user's input buffer
-    * Pointer is incremented so that next character will be written to the next position
-    * : dcb->input_size-- : Decreases remaining size of input buffer to show character has been stored
-    *
-    * If logic:
-    * : received_char == '\n' || dcb->input_size == 0 : Checks if received character is a newline, or if
-    * input buffer is full
-    * : dcb->status = DCB_IDLE : Sets status to idle since read operation is completed
-    * : dcb->event_flag = EVENT_FLAG_SET : Sets event flag to indicate completion
-    * end If;
-    * end If;
-    * end While;
-    *
-    */
-    cli();
-    unsigned short base = getDev(dcb->device_id);
-    static int escape_state = 0;
-    static char escape_buffer[3];
-    static int escape_index = 0;
-    static int index = 0;
-    static int input_count = 0;
-    char received_char;
-    size_t next_head;
+    int completed = -1;
+    int echoed = 0;
     int i;
-    while (inb(base + 5) & 0x01) // While data is available in the Receiver Buffer
+
+    if (dcb->mode == SERIAL_MODE_RAW)
+    {
+        return tty_raw(dcb);
+    }
+
+    char received_char;
+    while (dcb->rx.status == DCB_READING && ring_take(dcb, &received_char, 1))
     {
-        received_char = inb(base);
-        if (escape_state > 0)
+        char* line = dcb->rx.buffer;
+        echoed = 1;
+
+        if (dcb->escape_state == 1)
+        {
+            dcb->escape_state = (received_char == '[') ? 2 : 0;
+        }
+        else if (dcb->escape_state == 2)
         {
-            escape_buffer[escape_index++] = received_char;
-            if (escape_state == 1 && received_char == '[')
+            if (received_char == 'C' && dcb->edit_index < dcb->input_count)
             {
-                escape_state = 2;
+                // Right arrow key
+                tty_echo(dcb, line[dcb->edit_index++]);
             }
-            else if (escape_state == 2)
+            else if (received_char == 'D' && dcb->edit_index > 0)
             {
-                if (received_char == 'A') {
-                    // Up arrow key
-                    
-                }
-                else if (received_char == 'B') {
-                    // Down arrow key
-                    
-                }
-                else if (received_char == 'C') {
-                    // Right arrow key
-                    if (index < input_count)
-                    {
-                        outb(base, dcb->input_buffer[index]);
-                        index++;
-                    }
-                }
-                else if (received_char == 'D') {
-                    
-                    // Left arrow key
-                    if (index > 0)
-                    {
-                        index--;
-                        outb(base, '\b');
-                    }
-                }
-                escape_state = 0;
-                escape_index = 0;
-                continue;
+                // Left arrow key
+                dcb->edit_index--;
+                tty_echo(dcb, '\b');
             }
+            // Up and down arrow keys are ignored
+            dcb->escape_state = 0;
         }
         else if (received_char == '\033')
         {
-            escape_state = 1;
-            escape_index = 0;
-            escape_buffer[escape_index++] = received_char;
-            continue;
+            dcb->escape_state = 1;
         }
         else if (received_char == KEY_BACKSPACE || received_char == MAC_DELETE)
         {
-            if (index > 0)
+            if (dcb->edit_index > 0)
             {
-                index--;
-                for (i = index; i < input_count; i++)
+                dcb->edit_index--;
+                for (i = dcb->edit_index; i < dcb->input_count - 1; i++)
                 {
-                    dcb->input_buffer[i] = dcb->input_buffer[i + 1];
+                    line[i] = line[i + 1];
                 }
-                input_count--;
-                outb(base, '\b');
-                for (i = index; i < input_count; i++)
+                dcb->input_count--;
+                tty_echo(dcb, '\b');
+                for (i = dcb->edit_index; i < dcb->input_count; i++)
                 {
-                    outb(base, dcb->input_buffer[i]);
+                    tty_echo(dcb, line[i]);
                 }
-                outb(base, ' ');
-                for (i = index; i <= input_count; i++)
+                tty_echo(dcb, ' ');
+                for (i = dcb->edit_index; i <= dcb->input_count; i++)
                 {
-                    outb(base, '\b');
+                    tty_echo(dcb, '\b');
                 }
-
             }
         }
-        else
+        else if (received_char == KEY_CARRIAGE_RETURN || received_char == KEY_NEWLINE)
         {
-            
-    
-            next_head = (dcb->ring_head + 1) % sizeof(dcb->ring_buffer);
-            if (next_head != dcb->ring_tail && dcb->status != DCB_READING) // Check if buffer is not full
+            tty_echo(dcb, '\n');
+            line[dcb->input_count] = '\0';
+            completed = dcb->input_count;
+            dcb->rx_count = completed;
+            dcb->input_count = 0;
+            dcb->edit_index = 0;
+            dcb->rx.status = DCB_IDLE;  // Set status to DCB_IDLE
+            dcb->rx.event_flag = EVENT_FLAG_SET;  // Indicate reading completion
+        }
+        else if ((size_t)dcb->input_count + 1 < dcb->rx.size)
+        {
+            for (i = dcb->input_count; i > dcb->edit_index; i--)
             {
-                if (index < input_count)
-                {
-                    for (i = input_count; i > index; i--)
-                    {
-                        dcb->ring_buffer[i] = dcb->ring_buffer[i - 1];
-                    }
-                    dcb->ring_buffer[index] = received_char;
-                }
-                else
-                {
-                    dcb->ring_buffer[dcb->ring_head] = received_char;
-                }
-                dcb->ring_head = next_head;
+                line[i] = line[i - 1];
             }
+            line[dcb->edit_index++] = received_char;
+            dcb->input_count++;
 
-            // If the device is in DCB_READING state, copy data directly to input buffer
-            if (dcb->status == DCB_READING && dcb->input_size > 0)
+            // Redraw from the new character to the end of the line, then move the cursor back
+            for (i = dcb->edit_index - 1; i < dcb->input_count; i++)
             {
-                if (received_char == '\n' || received_char == '\r')
-                {
-                    outb(base, '\n');
-                    dcb->status = DCB_IDLE;  // Set status to DCB_IDLE
-                    dcb->event_flag = EVENT_FLAG_SET;  // Indicate reading completion
-                    input_count = 0;
-                    index = 0;
-                    break;
-                }
-                if (index < input_count)
-                {
-                    for (i = input_count; i > index; i--)
-                    {
-                        dcb->input_buffer[i] = dcb->input_buffer[i - 1];
-                        
-                    }
-                    dcb->input_buffer[index] = received_char;
-                    index++;
-
-                    for (i = index - 1; i <= input_count + 1; i++)
-                    {
-                        outb(base, dcb->input_buffer[i]);
-                    }
-
-                    for (i = index; i <= input_count; i++)
-                    {
-                        outb(base, '\b');
-                    }
-                }
-                else
-                {
-                    dcb->input_buffer[index++] = received_char;
-                    outb(base, received_char);
-                }
-                input_count++;
-                dcb->input_size--;
-
-
+                tty_echo(dcb, line[i]);
+            }
+            for (i = dcb->edit_index; i < dcb->input_count; i++)
+            {
+                tty_echo(dcb, '\b');
             }
         }
-        }
+    }
 
+    if (echoed)
+    {
+        serial_output_interrupt(dcb); // Start sending the echo
+    }
+    return completed;
+}
 
-        //index++;
-      
-        //INPUT HANDLING LOGIC
 
-       
-    sti();
-}
+/*
+* Copies the pending part of the current write into the transmit ring, as far as it has room.
+* Once the whole write has been copied the caller's buffer is no longer needed, so the write is
+* complete: status goes back to DCB_IDLE and the event flag is set.
+*/
+static void tx_fill(struct dcb* dcb)
+{
+    while (dcb->tx.status == DCB_WRITING && dcb->tx.size > 0)
+    {
+        size_t next_head = (dcb->tx_head + 1) % SERIAL_TX_RING_SIZE;
+        if (next_head == dcb->tx_tail) //Ring is full
+        {
+            return;
+        }
+        dcb->tx_ring[dcb->tx_head] = *dcb->tx.buffer++;
+        dcb->tx.size--;
+        dcb->tx_head = next_head;
+    }
 
+    if (dcb->tx.status == DCB_WRITING && dcb->tx.size == 0)
+    {
+        dcb->tx.status = DCB_IDLE;          // Set status to DCB_IDLE
+        dcb->tx.event_flag = EVENT_FLAG_SET;  // Indicate writing completion
+    }
+}
 
 /*
 * Determine base of IO, same as above
 * If logic:
-* : dcb->status == DCB_WRITING : Check if dcb is in the writing state
-* : && dcb->output_size > 0 : Checks if there is still data left to be sent in the output buffer
-*
-* : outb(base, *dcb->output_buffer++): Sends one byte of data from output buffer to serial port
-*   : *dcb->output_buffer++ : Dereferences pointer to get current byte to be sent, increments to point to
-* next character in the buffer
-* : dcb->output_size-- : Decrements output_size, which keeps track of how many bytes
-* are left in the output buffer to transmit, by one to indicate one byte has been sent
-*
-* If logic:
-* : dcb->output_size == 0 : Checks if all data in the output buffer has been sent
-*
-* : dcb->status = DCB_IDLE : Set status to DCB_IDLE as port is no longer writing
-* : dcb->event_flag = EVENT_FLAG_SET : Set event flag to indicate completion
+* : inb(base + LSR) & 0x20 : With the FIFO on, THR empty means the whole transmit FIFO is empty,
+* so up to SERIAL_FIFO_SIZE bytes can be moved from the ring without checking again. If it is not
+* empty (a previous burst is still going out) nothing is sent and the next THR empty interrupt continues.
 *
+* The ring is topped up from the pending write before and after the burst, and THR empty interrupts
+* stay enabled exactly as long as the ring has bytes left to send.
 */
-unsigned short base;
-unsigned char ier;
 void serial_output_interrupt(struct dcb* dcb)
 {
-    cli();
-    base = getDev(dcb->device_id);
-    while (dcb->status == DCB_WRITING && dcb->output_size > 0) {
-        outb(base, *dcb->output_buffer++);
-        dcb->output_size--;
-        if (dcb->output_size == 0) {
-            dcb->status = DCB_IDLE;          // Set status to DCB_IDLE
-            dcb->event_flag = EVENT_FLAG_SET;  // Indicate writing completion
-
-            //disables the transmitter holding register empty interrupt
-            ier = inb(base + 1);
-            outb(base + 1, ier & ~0x02);
+    unsigned int flags;
+    irq_save(flags); //Also called from sys_call() and the ISR, which must stay uninterrupted
+    unsigned short base = dcb->device_id;
+    unsigned char ier;
+    tx_fill(dcb);
+
+    if (inb(base + LSR) & 0x20) {
+        for (int sent = 0; sent < SERIAL_FIFO_SIZE && dcb->tx_tail != dcb->tx_head; sent++) {
+            outb(base, dcb->tx_ring[dcb->tx_tail]);
+            dcb->tx_tail = (dcb->tx_tail + 1) % SERIAL_TX_RING_SIZE;
         }
+        tx_fill(dcb);
     }
-    sti();
+
+    //enables the transmitter holding register empty interrupt only while there is more to send
+    ier = inb(base + 1);
+    if (dcb->tx_head != dcb->tx_tail) {
+        outb(base + 1, ier | 0x02);
+    }
+    else {
+        outb(base + 1, ier & ~0x02);
+    }
+    irq_restore(flags);
 }
 
 
 
+//Calls the second-level handler for one interrupt reported by a port's IIR
+static void serial_service(struct dcb* dcb, unsigned char interrupt_id)
+{
+    unsigned short base = dcb->device_id;
+
+	/*
+	*  Now that we have the interrupt_id, we need to determine what type of interrupt it is and handle accordingly
+	*  Interrupt type information is stored in bits 1 and 2 r6d_16, plus bit 3 with the FIFOs on
+	*  unsigned char interrupt_type = interrupt_id & 0x0E;
+	*  : interrupt_id & 0x0E : Basic bitwise operator to mask all but bits 1 to 3 of the interrupt_id (0x0E is 00001110 in binary)
+	*  Then we use a switch statement on the interrupt type to determine what second-level handler needs called
+	*
+    *   Info pulled from r6d_16
+    *   case 0x00: (0000000) Modem Status interrupt: Just read modem status register to clear interrupt, shouldn't happen.
+    *   case 0x02: (00000010) Output Interrupt, call second-level output handler
+    *   case 0x04: (00000100) Input Interrupt, call second-levle input handler
+    *   case 0x06: (00000110) Line Status Interrupt: Just read LSR to clear, shouldn't happen.
+    *   case 0x0C: (00001100) Receive timeout: fewer than rx_trigger bytes are waiting and the line went quiet,
+    *              handled like an input interrupt so short input is not stuck in the FIFO
+    *
+    */
+
+    unsigned char interrupt_type = interrupt_id & 0x0E; //Bitwise to mask non-important bits (keep bits 1 to 3)
+    switch (interrupt_type)
+    {
+    case 0x00:
+        inb(base + 6);
+        break;
+    case 0x02:
+        serial_output_interrupt(dcb);
+        break;
+    case 0x04:
+        serial_input_interrupt(dcb, 0);
+        break;
+    case 0x0C:
+        serial_input_interrupt(dcb, 1);
+        break;
+    case 0x06:
+        inb(base + 5);
+        break;
+    default:
+        break;
+    }
+}
+
 void serial_interrupt(void)
 {
     
     cli();
-    for (int dev = 1; dev <= 4; dev++) {
-        dcb* dcb = dcb_array[dev-1]; // Retrieve the associated DCB
-        if (!dcb || !dcb->open) {
-            continue; // If the port is not open, skip
-        }
-
-        unsigned short base = getDev(dev); //Get base IO of device
-        unsigned char interrupt_id = inb(base + 2); //Get interrupt ID from device r6d_12
-
-        if ((interrupt_id & 0x01) != 0) //Check if interrupt is pending
-        {
-            continue;
-        }
+    /*
+    * Both serial IRQ lines come here, and each line is shared by two ports, so every open port is checked.
+    * A port is serviced until its IIR reports nothing pending (bit 0 set), then the pass is repeated until
+    * a whole pass finds nothing. A port that raised a new interrupt while another was being serviced is
+    * handled now instead of being lost, since the PIC only sees the next edge once all of them are clear.
+    */
+    int pending;
+    do {
+        pending = 0;
+        for (int i = 0; i < 4; i++) {
+            dcb* dcb = dcb_array[i]; // Retrieve the associated DCB
+            if (!dcb || !dcb->open) {
+                continue; // If the port is not open, skip
+            }
 
-		/*
-		*  Now that we have the interrupt_id, we need to determine what type of interrupt it is and handle accordingly
-		*  Interrupt type information is stored in bits 1 and 2 r6d_16
-		*  unsigned char interrupt_type = interrupt_id & 0x0E;
-		*  : interrupt_id & 0x0E : Basic bitwise operator to mask all but bits 1 and 2 of the interrupt_id (0x06 is 00000110 in binary)
-		*  Then we use a switch statement on the interrupt type to determine what second-level handler needs called
-		*
-	    *   Info pulled from r6d_16
-	    *   case 0x00: (0000000) Modem Status interrupt: Just read modem status register to clear interrupt, shouldn't happen.
-	    *   case 0x02: (00000010) Output Interrupt, call second-level output handler
-	    *   case 0x04: (00000100) Input Interrupt, call second-levle input handler
-	    *   case 0x06: (00000110) Line Status Interrupt: Just read LSR to clear, shouldn't happen.
-	    *
-	    */
-
-        unsigned char interrupt_type = interrupt_id & 0x06; //Bitwise to mask non-important bits (keep bits 1 and 2)
-        switch (interrupt_type)
-        {
-        case 0x00:
-            inb(base + 6);
-            break;
-        case 0x02:
-            serial_output_interrupt(dcb);
-            break;
-        case 0x04:
-            serial_input_interrupt(dcb);
-            break;
-        case 0x06:
-            inb(base + 5);
-            break;
-        default:
-            break;
+            unsigned short base = dcb->device_id; //Get base IO of device
+            unsigned char interrupt_id;
+            while (((interrupt_id = inb(base + IIR)) & 0x01) == 0) //Get interrupt ID from device r6d_12, bit 0 clear while one is pending
+            {
+                pending = 1;
+                serial_service(dcb, interrupt_id);
+            }
         }
-       
-    }
-    outb(0x20, 0x20);
+    } while (pending);
+    outb(PIC_COMMAND_PORT, PIC_EOI);
     sti();
-    
-   
-
-
 }
-
-
-
-
-
-
-
-
-
@@ -12,6 +12,8 @@
 #include <mpx/io.h>
 #include <pcb.h>
 #include <io_scheduler.h>
+#include <mem_lib.h>
+#include <mpx/vm.h>
 
 
 
@@ -20,21 +22,56 @@
 pcb* current_process = NULL;
 context* original_context = NULL;
 
-context* sys_call(context* new_context) {
+// Blocks the running process and switches to the next ready one, for every request that has to wait
+static context* block_current(context* new_context) {
+    // The blocked process sees 0 unless whatever wakes it stores a result here
+    new_context->eax = 0;
+    current_process->stack_pointer = (unsigned char*)new_context;
+    current_process->exec_state = BLOCKED;
+    pcb_insert(current_process);
+
+    pcb* temp = ready_head; // Get the head of the ready queue
+    if (temp == NULL) {
+        return new_context;  // No ready processes, stay idle
+    }
+    current_process = temp;       // Get the next process
+    pcb_remove(current_process);  // Remove it from the ready queue
+    current_process->exec_state = RUNNING;  // Mark it as running
+    return (context*)current_process->stack_pointer; // Return its context
+}
+
+// Handles the request and picks the process to run next
+static context* dispatch(context* new_context) {
 
     int EAX = new_context->eax;
     for (int i = 0; i < 4; i++) {
         dcb* dcb = dcb_array[i];
-        if (dcb != NULL && dcb->event_flag == EVENT_FLAG_SET) {
+        if (dcb == NULL) {
+            continue;
+        }
+
+        // Echo and edit the input the ISR has collected since the last call
+        if (dcb->open) {
+            serial_tty(dcb);
+        }
+
+        // Receive and transmit complete independently, so each has its own flag and queue
+        if (dcb->rx.event_flag == EVENT_FLAG_SET) {
             // Reset event flag
-            dcb->event_flag = EVENT_FLAG_CLEAR;
+            dcb->rx.event_flag = EVENT_FLAG_CLEAR;
 
             // Process the next IOCB in the queue, if any
-            process_next_iocb(dcb);
-
+            process_next_iocb(dcb, READ);
+        }
+        if (dcb->tx.event_flag == EVENT_FLAG_SET) {
+            dcb->tx.event_flag = EVENT_FLAG_CLEAR;
+            process_next_iocb(dcb, WRITE);
         }
 
     }
+    // Input may have arrived or output drained, so check on processes blocked in SELECT
+    io_select_wake();
+
     // If EAX is IDLE, the process gives up CPU control temporarily
     if (EAX == IDLE) {
 
@@ -42,6 +79,13 @@ context* sys_call(context* new_context) {
             original_context = new_context;
         }
 
+        // Nothing else is runnable, so catch up on deferred heap merging and
+        // zero some frames ahead of time
+        if (current_process != NULL && !strcmp(current_process->name, "sysidle")) {
+            heap_defragment();
+            vm_prezero_frames();
+        }
+
         pcb* temp = ready_head;
         if (temp == NULL) {
             new_context->eax = 0;
@@ -69,6 +113,8 @@ context* sys_call(context* new_context) {
         if (temp == NULL) {
             new_context->eax = 0;
             context* temporary = original_context;
+            // The last process goes too; kmain() releases its stack once it is back on its own
+            pcb_free(current_process);
             current_process = NULL;
             original_context = NULL;
             return temporary;
@@ -103,66 +149,45 @@ context* sys_call(context* new_context) {
         char* buffer = (char*)new_context->ecx;
         size_t size = (size_t)new_context->edx;
 
-        // Validate device and check status
-        dcb* dcb = dcb_array[get_dcb_index(dev) - 1];
-        /*if (dcb->status == DCB_READING && dcb->input_buffer - buffer <= 100)
+        // Validate device and check status; a port that was never opened is turned away by serial_read()
+        dcb* dcb = isValidDevice(dev) ? dcb_array[get_dcb_index(dev) - 1] : NULL;
+        /*if (dcb->rx.status == DCB_READING && dcb->rx.buffer - buffer <= 100)
         {
             return new_context;
         }*/
-        if (dcb->status != DCB_IDLE) {
-            // If the device is busy, add request to I/O scheduler and block the process
-            if (current_process != NULL) {
-            if (!strcmp(current_process->name, "sysidle"))
-            {
-                new_context->eax = serial_read(dev, buffer, size);
+        if (dcb != NULL && dcb->rx.status != DCB_IDLE) {
+            // If a read is already in progress, add request to I/O scheduler and block the process
+            if (current_process == NULL) {
+                new_context->eax = -1;
                 return new_context;
             }
-            
-            
-                io_scheduler(READ, dev, buffer, size, current_process, 0);
-                current_process->stack_pointer = (unsigned char*)new_context;
-                current_process->exec_state = BLOCKED;
-                pcb_insert(current_process);
-            }
 
-            // Dispatch new process as though EAX == IDLE
-            pcb* temp = ready_head; // Get the head of the ready queue
-            if (temp == NULL) {
-                new_context->eax = 0;  // No ready processes, stay idle
+            // With the device's IOCB pool used up the request is turned away instead of queued
+            int ret = io_scheduler(READ, dev, buffer, size, current_process, 0);
+            if (ret != SUCCESS) {
+                new_context->eax = ret;
                 return new_context;
             }
-            else {
-                // If a process exists in the ready queue, schedule it
-                current_process = temp;       // Get the next process
-                pcb_remove(current_process);  // Remove it from the ready queue
-                current_process->exec_state = RUNNING;  // Mark it as running
-                new_context->eax = 0;         // Clear EAX
-                return (context*)current_process->stack_pointer; // Return its context
-            }
+            return block_current(new_context);
         }
         else {
             // Device is available; start the read operation
-            new_context->eax = serial_read(dev, buffer, size);
-            if (dcb->event_flag == EVENT_FLAG_CLEAR)
+            int ret = serial_read(dev, buffer, size);
+            new_context->eax = ret;
+            if (ret >= 0) {
+                dcb->rx.owner = current_process;
+            }
+
+            // Only a read that started and is still waiting for input blocks; a rejected one returns its error
+            if (ret >= 0 && dcb->rx.status == DCB_READING && dcb->rx.event_flag == EVENT_FLAG_CLEAR
+                && current_process != NULL)
             {
-                io_scheduler(READ, dev, buffer, size, current_process, 1);
-                current_process->stack_pointer = (unsigned char*)new_context;
-                current_process->exec_state = BLOCKED;
-             
-                pcb_insert(current_process);
-                pcb* temp = ready_head; // Get the head of the ready queue
-                if (temp == NULL) {
-                    new_context->eax = 0;  // No ready processes, stay idle
+                ret = io_scheduler(READ, dev, buffer, size, current_process, 1);
+                if (ret != SUCCESS) {
+                    new_context->eax = ret;
                     return new_context;
                 }
-                else {
-                    // If a process exists in the ready queue, schedule it
-                    current_process = temp;       // Get the next process
-                    pcb_remove(current_process);  // Remove it from the ready queue
-                    current_process->exec_state = RUNNING;  // Mark it as running
-                    new_context->eax = 0;         // Clear EAX
-                    return (context*)current_process->stack_pointer; // Return its context
-                }
+                return block_current(new_context);
             }
             return new_context;
         }
@@ -192,42 +217,100 @@ context* sys_call(context* new_context) {
         char* buffer = (char*)new_context->ecx; //Works
         size_t size = (size_t)new_context->edx; //Works
 
-        dcb* dcb = dcb_array[get_dcb_index(dev) - 1]; //Works
-        if (dcb->status != DCB_IDLE)
+        dcb* dcb = isValidDevice(dev) ? dcb_array[get_dcb_index(dev) - 1] : NULL; //NULL is turned away by serial_write()
+        if (dcb != NULL && dcb->tx.status != DCB_IDLE)
         {
-            if (current_process != NULL) {
-            if (!strcmp(current_process->name, "sysidle"))
-            {
-                new_context->eax = serial_write(dev, buffer, size);
+            // Only another write holds up a write; a pending read does not
+            if (current_process == NULL) {
+                new_context->eax = -1;
                 return new_context;
             }
-                io_scheduler(WRITE, dev, buffer, size, current_process, 0);
-                current_process->stack_pointer = (unsigned char*)new_context;
-                current_process->exec_state = BLOCKED;
-                pcb_insert(current_process);
-            }
 
-            // Dispatch new process as though EAX == IDLE
-            pcb* temp = ready_head; // Get the head of the ready queue
-            if (temp == NULL) {
-                new_context->eax = 0;  // No ready processes, stay idle
+            // With the device's IOCB pool used up the request is turned away instead of queued
+            int ret = io_scheduler(WRITE, dev, buffer, size, current_process, 0);
+            if (ret != SUCCESS) {
+                new_context->eax = ret;
                 return new_context;
             }
-            else {
-                // If a process exists in the ready queue, schedule it
-                current_process = temp;       // Get the next process
-                pcb_remove(current_process);  // Remove it from the ready queue
-                current_process->exec_state = RUNNING;  // Mark it as running
-                new_context->eax = 0;         // Clear EAX
-                return (context*)current_process->stack_pointer; // Return its context
-            }
+            return block_current(new_context);
         }
         else
         {
-            new_context->eax = serial_write(dev, buffer, size);
+            int ret = serial_write(dev, buffer, size);
+            new_context->eax = ret;
+            if (ret == SUCCESS) {
+                dcb->tx.owner = current_process;
+            }
+
+            // The transmit ring could not take the whole buffer, so wait until the ISR has copied the rest.
+            // A rejected write (e.g. zero length) never started and returns its error instead
+            if (ret == SUCCESS && dcb->tx.status == DCB_WRITING && dcb->tx.event_flag == EVENT_FLAG_CLEAR
+                && current_process != NULL)
+            {
+                ret = io_scheduler(WRITE, dev, buffer, size, current_process, 1);
+                if (ret != SUCCESS) {
+                    new_context->eax = ret;
+                    return new_context;
+                }
+                return block_current(new_context);
+            }
+            return new_context;
+        }
+
+    }
+
+    // Async requests are started or queued and the caller carries on with a handle
+    else if (EAX == READ_ASYNC || EAX == WRITE_ASYNC)
+    {
+        if (current_process == NULL) {
+            new_context->eax = -1;
+            return new_context;
+        }
+        new_context->eax = io_submit(EAX == READ_ASYNC ? READ : WRITE, (device)new_context->ebx,
+            (char*)new_context->ecx, (size_t)new_context->edx, current_process);
+        return new_context;
+    }
+
+    else if (EAX == POLL)
+    {
+        new_context->eax = io_poll((int)new_context->ebx, current_process);
+        return new_context;
+    }
+
+    // WAIT returns the result straight away if the request is done, otherwise the process blocks
+    // until process_next_iocb() completes it and puts the result in its EAX
+    else if (EAX == WAIT)
+    {
+        int result = 0;
+        int ret = io_wait((int)new_context->ebx, current_process, &result);
+        if (ret == 0) {
+            return block_current(new_context);
+        }
+        new_context->eax = (ret < 0) ? ret : result;
+        return new_context;
+    }
+
+    // SELECT returns the index of the first ready device, blocking once if none is ready yet
+    else if (EAX == SELECT)
+    {
+        if (current_process == NULL) {
+            new_context->eax = -1;
             return new_context;
         }
+        int fired = 0;
+        int ret = io_select((struct select_entry*)new_context->ecx, (int)new_context->edx, current_process, &fired);
+        if (ret == 0) {
+            return block_current(new_context);
+        }
+        new_context->eax = (ret < 0) ? ret : fired;
+        return new_context;
+    }
 
+    // Changing device settings never blocks
+    else if (EAX == IOCTL)
+    {
+        new_context->eax = serial_ioctl((device)new_context->ebx, (int)new_context->ecx, (int)new_context->edx);
+        return new_context;
     }
 
     // Check each DCB for completed I/O operations
@@ -235,3 +318,14 @@ context* sys_call(context* new_context) {
     new_context->eax = -1;
     return new_context;
 }
+
+context* sys_call(context* new_context) {
+    // A process that exited in the last call is off its stack now, so the stack can go
+    pcb_reap();
+
+    context* next_context = dispatch(new_context);
+
+    // Run the chosen process in its own address space (the kernel's when nothing is running)
+    vm_switch_space(current_process != NULL ? current_process->page_dir : 0);
+    return next_context;
+}
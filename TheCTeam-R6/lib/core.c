@@ -53,8 +53,12 @@ void *sys_alloc_mem(size_t size)
 	return malloc_function ? malloc_function(size) : kmalloc(size, 0, NULL);
 }
 
-/* Free memory if a student function is available, otherwise NOP. */
+/* Free memory from the kernel heap if it came from kmalloc(), otherwise
+ * through the student function if one is available. */
 int sys_free_mem(void *ptr)
 {
+	if (kfree(ptr) == 0) {
+		return 0;
+	}
 	return free_function ? free_function(ptr) : -1;
 }
@@ -16,6 +16,24 @@
 
 mcb *heap_head = NULL;  //head of the list
 
+//end of the region the allocator has ever written to; everything past it is still zero
+static char *heap_dirty_end = NULL;
+
+//running counters reported by heap_get_stats()
+static heap_stats counters = { 0 };
+
+//quick lists sort deferred blocks into QUICK_LIST_GRANULE sized classes up to QUICK_LIST_MAX bytes
+#define QUICK_LIST_GRANULE 16
+#define QUICK_LIST_MAX 512
+#define QUICK_LIST_COUNT (QUICK_LIST_MAX / QUICK_LIST_GRANULE + 1)
+
+//deferred blocks allowed to pile up before they are merged without waiting for idle
+#define QUICK_LIST_LIMIT 64
+
+static int deferred_coalescing = 0;
+static mcb *quick_lists[QUICK_LIST_COUNT] = { 0 };
+static size_t deferred_count = 0;
+
 void initialize_heap(size_t size) {
     //allocates memory for the initial block
     mcb *initial_block = (mcb *) sys_alloc_mem(size + sizeof(mcb));
@@ -31,112 +49,502 @@ void initialize_heap(size_t size) {
     initial_block->status = FREE;
     initial_block->next = NULL;
     initial_block->prev = NULL;
+    initial_block->owner = NULL;
 
     heap_head = initial_block;
+    //the arena comes from fresh kernel heap pages, which are zeroed on first touch,
+    //so callocate_memory() can skip memory that was never handed out
+    heap_dirty_end = (char *)initial_block->start_addr;
+    counters.heap_size = size + sizeof(mcb);
 }
 
 
 
-//initializes memory and places it in the list. Possibly splits a free block in half.
-void *allocate_memory(size_t size) {
+//adjusts the bytes in use and keeps the peak up to date
+static void account(size_t added, size_t removed) {
+    counters.bytes_in_use += added;
+    counters.bytes_in_use -= removed;
+
+    if (counters.bytes_in_use > counters.peak_bytes_in_use) {
+        counters.peak_bytes_in_use = counters.bytes_in_use;
+    }
+}
+
+
+
+#ifdef HEAP_TRACE
+//appends a space and value in hex to a trace line
+static size_t trace_hex(char *line, size_t pos, size_t value) {
+    char digits[2 * sizeof(size_t)];
+    size_t count = 0;
+
+    do {
+        digits[count++] = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+
+    line[pos++] = ' ';
+    while (count > 0) {
+        line[pos++] = digits[--count];
+    }
+    return pos;
+}
+#endif
+
+//writes one allocator call to COM2 in the format read by bench/heap_bench
+static void trace_record(char op, void *id, void *new_id, size_t count, size_t size) {
+#ifdef HEAP_TRACE
+    static int trace_ready = 0;
+    char line[64];
+    size_t pos = 0;
+
+    if (!trace_ready) {
+        serial_init(COM2);
+        trace_ready = 1;
+    }
+
+    line[pos++] = op;
+    pos = trace_hex(line, pos, (size_t)id);
+    if (op == 'r') {
+        pos = trace_hex(line, pos, (size_t)new_id);
+    }
+    if (op == 'c') {
+        pos = trace_hex(line, pos, count);
+    }
+    if (op != 'f') {
+        pos = trace_hex(line, pos, size);
+    }
+    line[pos++] = '\n';
+    serial_out(COM2, line, pos);
+#else
+    (void)op;
+    (void)id;
+    (void)new_id;
+    (void)count;
+    (void)size;
+#endif
+}
+
+
+
+//finds the mcb whose usable memory starts at the given address
+static mcb *find_block(void *address) {
     mcb *current = heap_head;
 
-    //traverses the list to find a suitable free block
     while (current != NULL) {
-        //checks if block is free and large enough
-        if (current->status == FREE && current->size >= size) {
+        if (current->start_addr == address) {
+            return current;
+        }
+        current = current->next;
+    }
+    return NULL;
+}
 
-            //splits the block if there's enough space
-            if (current->size > size + sizeof(mcb)) {
+//records that everything up to the end of the block (and the mcb that may follow it) has been written
+static void mark_dirty(mcb *block) {
+    char *end = (char *)block->start_addr + block->size + sizeof(mcb);
 
-                //calculate address for the new MCB
-                mcb *new_block = (mcb *) ((char *)current->start_addr + size);
+    if (end > heap_dirty_end) {
+        heap_dirty_end = end;
+    }
+}
 
-                //sets up the new MCB
-                new_block->start_addr = (void *)((char *)new_block + sizeof(mcb));
-                new_block->size = current->size - size - sizeof(mcb);
-                new_block->status = FREE;
-                new_block->next = current->next;
-                new_block->prev = current;
+//shrinks a block to size, turning the tail into a new free block if there is room for an mcb
+static void split_block(mcb *current, size_t size) {
+    if (current->size <= size + sizeof(mcb)) {
+        return;
+    }
 
-                //updates the next block's prev pointer if it exists
-                if (current->next != NULL) {
-                    current->next->prev = new_block;
-                }
+    //calculate address for the new MCB
+    mcb *new_block = (mcb *) ((char *)current->start_addr + size);
 
-                //links the new block into the list
-                current->next = new_block;
+    //sets up the new MCB
+    new_block->start_addr = (void *)((char *)new_block + sizeof(mcb));
+    new_block->size = current->size - size - sizeof(mcb);
+    new_block->status = FREE;
+    new_block->next = current->next;
+    new_block->prev = current;
+    new_block->owner = NULL;
 
-                //adjusts the size of the current block
-                current->size = size;
-            }
+    //updates the next block's prev pointer if it exists
+    if (current->next != NULL) {
+        current->next->prev = new_block;
+    }
+
+    //links the new block into the list
+    current->next = new_block;
+
+    //adjusts the size of the current block
+    current->size = size;
+}
+
+//folds the block after current into current
+static void absorb_next(mcb *current) {
+    mcb *next_block = current->next;
+
+    current->size += sizeof(mcb) + next_block->size;
+    current->next = next_block->next;
+
+    //links the node after the next_block to the current node
+    if (next_block->next != NULL) {
+        next_block->next->prev = current;
+    }
+}
+
+
+
+//links an allocated block into its owner's chain
+static void claim_block(mcb *block, pcb *owner) {
+    block->owner = owner;
+    block->owner_prev = NULL;
+    block->owner_next = NULL;
+
+    if (owner == NULL) {
+        return;
+    }
+
+    block->owner_next = owner->owned_blocks;
+    if (owner->owned_blocks != NULL) {
+        owner->owned_blocks->owner_prev = block;
+    }
+    owner->owned_blocks = block;
+}
+
+//unlinks a block from its owner's chain
+static void release_block(mcb *block) {
+    if (block->owner == NULL) {
+        return;
+    }
+
+    if (block->owner_prev != NULL) {
+        block->owner_prev->owner_next = block->owner_next;
+    }
+    else {
+        block->owner->owned_blocks = block->owner_next;
+    }
+    if (block->owner_next != NULL) {
+        block->owner_next->owner_prev = block->owner_prev;
+    }
+    block->owner = NULL;
+}
+
+
+
+//takes a block of at least size bytes off the quick lists, or returns NULL
+static mcb *take_deferred(size_t size) {
+    size_t index = (size + QUICK_LIST_GRANULE - 1) / QUICK_LIST_GRANULE;
+
+    if (deferred_count == 0 || index >= QUICK_LIST_COUNT) {
+        return NULL;
+    }
+
+    //a class holds sizes within one granule of each other, so the first block that fits is taken
+    mcb **link = &quick_lists[index];
+    while (*link != NULL) {
+        mcb *block = *link;
+        if (block->size >= size) {
+            *link = block->quick_next;
+            deferred_count--;
+            return block;
+        }
+        link = &block->quick_next;
+    }
+    return NULL;
+}
+
+//merges every run of adjacent free blocks in one pass over the list
+static void coalesce_heap(void) {
+    mcb *current = heap_head;
+
+    while (current != NULL) {
+        if (current->status == FREE && current->next != NULL && current->next->status == FREE) {
+            absorb_next(current);
+        }
+        else {
+            current = current->next;
+        }
+    }
+}
+
+
+
+//finds a block for size bytes, possibly splitting a free block in half.
+static void *allocate_block(size_t size) {
+    //reuses a recently freed block of the same size class without splitting
+    mcb *recycled = take_deferred(size);
+    if (recycled != NULL) {
+        recycled->status = ALLOCATED;
+        claim_block(recycled, current_process);
+        mark_dirty(recycled);
+        account(recycled->size, 0);
+        counters.alloc_count++;
+        return recycled->start_addr;
+    }
+
+    mcb *current = heap_head;
+
+    //traverses the list to find a suitable free block
+    while (current != NULL) {
+        //checks if block is free and large enough
+        if (current->status == FREE && current->size >= size) {
+            //splits the block if there's enough space
+            split_block(current, size);
             current->status = ALLOCATED;
+            claim_block(current, current_process);
+            mark_dirty(current);
+            account(current->size, 0);
+            counters.alloc_count++;
             return current->start_addr;
         }
         current = current->next;
     }
 
+    //merges the deferred blocks and tries again before giving up
+    if (deferred_count != 0) {
+        heap_defragment();
+        return allocate_block(size);
+    }
+
     // No suitable block found
+    counters.failed_allocs++;
     return NULL;
 }
 
 
 
+//updates memory block to free in the list. Also merges into adjecent free blocks.
+static int free_block(void *address) {
+    mcb *current = find_block(address);
+
+    if (current == NULL || current->status != ALLOCATED) {
+        return -1;
+    }
+
+    release_block(current);
+    account(0, current->size);
+    counters.free_count++;
+
+    //parks small blocks on a quick list and leaves the merge for later. A block next to free memory
+    //is merged now: left apart it only splits a free run and costs later allocations a fit
+    if (deferred_coalescing && current->size <= QUICK_LIST_MAX
+        && !(current->next != NULL && current->next->status == FREE)
+        && !(current->prev != NULL && current->prev->status == FREE)) {
+        size_t index = (current->size + QUICK_LIST_GRANULE - 1) / QUICK_LIST_GRANULE;
+
+        current->status = DEFERRED;
+        current->quick_next = quick_lists[index];
+        quick_lists[index] = current;
+        deferred_count++;
+
+        if (deferred_count > QUICK_LIST_LIMIT) {
+            heap_defragment();
+        }
+        return 0;
+    }
+
+    //mark block as free
+    current->status = FREE;
+
+    //merges with the next block if it's free
+    if (current->next != NULL && current->next->status == FREE) {
+        absorb_next(current);
+    }
+
+    //merges with the previous block if it's free
+    if (current->prev != NULL && current->prev->status == FREE) {
+        absorb_next(current->prev);
+    }
+    return 0;
+}
+
+
+
+//initializes memory and places it in the list. Possibly splits a free block in half.
+void *allocate_memory(size_t size) {
+    void *address = allocate_block(size);
+
+    trace_record('a', address, NULL, 1, size);
+    return address;
+}
+
+
+
 //frees memory and updates memory block to free in the list. Also merges into adjecent free blocks.
 int free_memory(void* address) {
-    struct mcb *current = heap_head;
+    int result = free_block(address);
 
-    //finds the mcb that matches to the given address
-    while (current != NULL) {
-        if (current->start_addr == (int*)address) {
-            //mark block as free
-            current->status = FREE;
+    if (result == 0) {
+        trace_record('f', address, NULL, 0, 0);
+    }
+    return result;
+}
+
+
+
+//allocates zeroed memory, only clearing the part of the block that has been used before
+void *callocate_memory(size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) {
+        return NULL;
+    }
+
+    size_t total = count * size;
+    char *previous_dirty_end = heap_dirty_end;
+    char *address = allocate_block(total);
+
+    if (address != NULL && address < previous_dirty_end) {
+        char *end = address + total;
+        memset(address, 0, (size_t)((end < previous_dirty_end ? end : previous_dirty_end) - address));
+    }
+    trace_record('c', address, NULL, count, size);
+    return address;
+}
+
+
+
+//resizes a block, growing into a free neighbour or shrinking in place before falling back to a copy
+void *reallocate_memory(void *address, size_t size) {
+    if (address == NULL) {
+        return allocate_memory(size);
+    }
+
+    if (size == 0) {
+        free_memory(address);
+        return NULL;
+    }
+
+    mcb *current = find_block(address);
+    if (current == NULL || current->status != ALLOCATED) {
+        return NULL;
+    }
+
+    size_t old_size = current->size;
+
+    //absorbs the next block if it is free and together they are big enough
+    if (current->size < size && current->next != NULL && current->next->status == FREE
+        && current->size + sizeof(mcb) + current->next->size >= size) {
+        absorb_next(current);
+    }
+
+    if (current->size >= size) {
+        split_block(current, size);
 
+        //merges the trimmed tail with the block after it so it does not sit fragmented
+        mcb *tail = current->next;
+        if (tail != NULL && tail->status == FREE && tail->next != NULL && tail->next->status == FREE) {
+            absorb_next(tail);
+        }
+        mark_dirty(current);
+        account(current->size, old_size);
+        trace_record('r', address, address, 1, size);
+        return address;
+    }
 
+    //no room in place, so move the data to a new block
+    void *moved = allocate_block(size);
+    if (moved != NULL) {
+        memcpy(moved, address, current->size);
+        free_block(address);
+    }
+    trace_record('r', address, moved, 1, size);
+    return moved;
+}
 
-            //merges with the next block if it's free
-            if (current->next != NULL) {
-                mcb *next_block = current->next;
 
-                if (next_block->status == FREE) {
-                    //merges current block with the next free block
-                    current->size += sizeof(mcb) + next_block->size;
-                    current->next = next_block->next;
 
+//copies the counters and walks the list for the free space figures
+void heap_get_stats(heap_stats *stats) {
+    *stats = counters;
+    stats->free_bytes = 0;
+    stats->free_blocks = 0;
+    stats->largest_free = 0;
 
-                    //links the node after the next_block to the current node
-                    if (next_block->next != NULL) {
-                        mcb *next_next_block = next_block->next;
-                        next_next_block->prev = current;
-                    }
-                }
+    for (mcb *current = heap_head; current != NULL; current = current->next) {
+        if (current->status == FREE || current->status == DEFERRED) {
+            stats->free_bytes += current->size;
+            stats->free_blocks++;
+            if (current->size > stats->largest_free) {
+                stats->largest_free = current->size;
             }
+        }
+    }
+
+    stats->deferred_blocks = deferred_count;
+    stats->fragmentation = 0;
+    if (stats->free_bytes != 0) {
+        stats->fragmentation = (int)(100 - (stats->largest_free * 100) / stats->free_bytes);
+    }
+}
 
 
 
-            //merges with the previous block if it's free
-            if (current->prev != NULL) {
-                struct mcb *prev_block = current->prev;
+//frees a process's whole chain, then coalesces the heap once
+int free_process_memory(pcb *owner) {
+    int freed = 0;
+    mcb *block = owner->owned_blocks;
+
+    while (block != NULL) {
+        block->status = FREE;
+        block->owner = NULL;
+        account(0, block->size);
+        counters.free_count++;
+        freed++;
+        block = block->owner_next;
+    }
+    owner->owned_blocks = NULL;
+
+    if (freed != 0) {
+        coalesce_heap();
+    }
+    return freed;
+}
+
+
+
+//hands an allocated block over to the kernel, so it outlives the process that allocated it
+int disown_memory(void *address) {
+    mcb *block = find_block(address);
+
+    if (block == NULL || block->status != ALLOCATED) {
+        return -1;
+    }
+    release_block(block);
+    return 0;
+}
 
-                if (prev_block->status == FREE) {
-                    //merges previous block with the current free block
-                    prev_block->size += sizeof(mcb) + current->size;
-                    prev_block->next = current->next;
 
-                    //links current (now prev_block) with the next node
-                    if (current->next != NULL) {
-                        mcb *next_block = current->next;
-                        next_block->prev = prev_block;
-                    }
-                    //moves current to the merged block
-                    current = prev_block;
-                }
+
+//returns every deferred block to the free list, merging each only with its neighbours
+void heap_defragment(void) {
+    if (deferred_count == 0) {
+        return;
+    }
+
+    //a block still on a quick list is never absorbed by a neighbour, so each one taken off is intact.
+    //the work is bounded by the number of deferred blocks, not the size of the heap
+    for (size_t i = 0; i < QUICK_LIST_COUNT; i++) {
+        while (quick_lists[i] != NULL) {
+            mcb *block = quick_lists[i];
+            quick_lists[i] = block->quick_next;
+            block->status = FREE;
+
+            if (block->next != NULL && block->next->status == FREE) {
+                absorb_next(block);
+            }
+            if (block->prev != NULL && block->prev->status == FREE) {
+                absorb_next(block->prev);
             }
-            return 0;
         }
-        current = current->next;
     }
-    return -1; 
+    deferred_count = 0;
 }
 
 
+
+//switches deferred coalescing on or off, flushing the quick lists when it is turned off
+void set_deferred_coalescing(int enabled) {
+    deferred_coalescing = enabled;
+
+    if (!enabled) {
+        heap_defragment();
+    }
+}
@@ -47,10 +47,11 @@ void help(void)
 	print_help(0,2, "Shutdown", "Asks for confirmation and exits the program.");
 	print_help(0,2, "Version", "Displays the current build version along with the build date.");
 	print_help(0,2, "Clear", "Clears the terminal.");
+	print_help(0,2, "Bench Switch", "Times a page directory switch with and without global kernel pages.");
 	print_help(0, 2, "Alarm", "Creates an alarm that reads a message out at a certain time. Usage: 'alarm create <time> <message> where time is in 00:00:00 format.");
 	print_help(1, 3, "Date", "Get", "Set");
 	print_help(1, 5, "Pcb", "Delete", "Suspend", "Resume", "Priority");
-	print_help(1, 7, "Show", "PCB", "Ready", "Blocked","Free", "Allocated", "All");
+	print_help(1, 8, "Show", "PCB", "Ready", "Blocked","Free", "Allocated", "Heap", "All");
 	print_help(1, 5, "Load", "Load R3", "Load R3 Priority", "Load R3 Suspended", "Load R3 Suspended Priority");
 }
 
@@ -86,6 +87,7 @@ void help_show(void)
 	print_detHelp(3, "Show All", "Shows the information of all PCBs in all queues", "Usage: 'show all'");
 	print_detHelp(3, "Show Allocated", "Shows all the allocated memory addresses as hexadecimal", "Usage: 'show allocated'");
 	print_detHelp(3, "Show Free", "Shows all the free memory addresses as hexadecimal", "Usage: 'show free'");
+	print_detHelp(3, "Show Heap", "Shows heap usage, peak usage, largest free block, fragmentation and allocation counts", "Usage: 'show heap'");
 
 }
 
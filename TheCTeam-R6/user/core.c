@@ -31,18 +31,41 @@ int sys_req(op_code op, ...)
 	device dev = 0;
 	char *buffer = NULL;
 	size_t len = 0;
+	int command = 0;
 
-	if (op == READ || op == WRITE) {
+	if (op == READ || op == WRITE || op == READ_ASYNC || op == WRITE_ASYNC) {
 		va_list ap;
 		va_start(ap, op);
 		dev = va_arg(ap, device);
 		buffer = va_arg(ap, char *);
 		len = va_arg(ap, size_t);
 		va_end(ap);
+	} else if (op == IOCTL) {
+		va_list ap;
+		va_start(ap, op);
+		dev = va_arg(ap, device);
+		command = va_arg(ap, int);
+		len = (size_t)va_arg(ap, int);
+		va_end(ap);
+	} else if (op == SELECT) {
+		va_list ap;
+		va_start(ap, op);
+		buffer = (char *)va_arg(ap, struct select_entry *);
+		len = (size_t)va_arg(ap, int);
+		va_end(ap);
+	} else if (op == POLL || op == WAIT) {
+		/* the request handle goes where the device would */
+		va_list ap;
+		va_start(ap, op);
+		dev = (device)va_arg(ap, int);
+		va_end(ap);
 	}
 
+	/* IOCTL passes its command where READ and WRITE pass the buffer */
+	unsigned int ecx = (op == IOCTL) ? (unsigned int)command : (unsigned int)buffer;
+
 	int ret = 0;
-	__asm__ volatile("int $0x60" : "=a"(ret) : "a"(op), "b"(dev), "c"(buffer), "d"(len));
+	__asm__ volatile("int $0x60" : "=a"(ret) : "a"(op), "b"(dev), "c"(ecx), "d"(len));
 
 	if (ret == -1 && (op == READ || op == WRITE)) {
 		return (op == READ)
@@ -11,6 +11,7 @@
 #include <mpx/io.h>
 #include <sys_call.h>
 #include <mem_lib.h>
+#include <mpx/vm.h>
 
 
 void address_print(int num)
@@ -93,15 +94,84 @@ void show_free_memory(void)
     char size[20];
     println(CYAN("Free Memory Blocks:"));
     while (current != NULL) {
-        if (current->status == FREE) {
+        //deferred blocks are free too, they just have not been merged with their neighbours yet
+        if (current->status == FREE || current->status == DEFERRED) {
             itoa(current->size, size);
             print(YELLOW("Address: "));
             address_print((int)current->start_addr);
             print(YELLOW("Size: "));
             print(size);
-            println("");
+            println(current->status == DEFERRED ? " (awaiting merge)" : "");
         }
         current = current->next;
     }
 }
 
+
+//appends a label and a number to the report
+static size_t append_stat(char *report, size_t pos, const char *label, size_t value, const char *unit)
+{
+    char number[20];
+    itoa((int)value, number);
+
+    for (const char *s = label; *s != '\0'; s++) {
+        report[pos++] = *s;
+    }
+    for (const char *s = number; *s != '\0'; s++) {
+        report[pos++] = *s;
+    }
+    for (const char *s = unit; *s != '\0'; s++) {
+        report[pos++] = *s;
+    }
+    report[pos] = '\0';
+    return pos;
+}
+
+void show_heap_stats(void)
+{
+    heap_stats stats;
+    char report[512];
+    size_t pos = 0;
+
+    heap_get_stats(&stats);
+
+    //builds the whole report first so it goes out in a single write
+    pos = append_stat(report, pos, CYAN("Heap Statistics:") "\n" YELLOW("Heap size: "), stats.heap_size, " bytes\n");
+    pos = append_stat(report, pos, YELLOW("In use: "), stats.bytes_in_use, " bytes\n");
+    pos = append_stat(report, pos, YELLOW("Peak in use: "), stats.peak_bytes_in_use, " bytes\n");
+    pos = append_stat(report, pos, YELLOW("Free: "), stats.free_bytes, " bytes");
+    pos = append_stat(report, pos, " in ", stats.free_blocks, " blocks\n");
+    pos = append_stat(report, pos, YELLOW("Largest free block: "), stats.largest_free, " bytes\n");
+    pos = append_stat(report, pos, YELLOW("Awaiting merge: "), stats.deferred_blocks, " blocks\n");
+    pos = append_stat(report, pos, YELLOW("Fragmentation: "), (size_t)stats.fragmentation, "%\n");
+    pos = append_stat(report, pos, YELLOW("Allocations: "), stats.alloc_count, "\n");
+    pos = append_stat(report, pos, YELLOW("Frees: "), stats.free_count, "\n");
+    pos = append_stat(report, pos, YELLOW("Failed allocations: "), stats.failed_allocs, "\n");
+
+    sys_req(WRITE, COM1, report, pos);
+}
+
+
+
+//number of page directory switches timed in each run of bench_switch()
+#define BENCH_SWITCH_ITERATIONS 1000
+
+void bench_switch(void)
+{
+    char report[256];
+    size_t pos = 0;
+
+    uint32_t with_global = vm_bench_switch(1, BENCH_SWITCH_ITERATIONS);
+    uint32_t without_global = vm_bench_switch(0, BENCH_SWITCH_ITERATIONS);
+
+    if (with_global == 0 || without_global == 0) {
+        print_e("Error: Not enough memory for a second page directory");
+        return;
+    }
+
+    pos = append_stat(report, pos, CYAN("Page Directory Switch:") "\n" YELLOW("Switches timed: "), BENCH_SWITCH_ITERATIONS, "\n");
+    pos = append_stat(report, pos, YELLOW("With global pages: "), with_global, " cycles\n");
+    pos = append_stat(report, pos, YELLOW("Without global pages: "), without_global, " cycles\n");
+
+    sys_req(WRITE, COM1, report, pos);
+}